@@ -0,0 +1,393 @@
+/*
+ * Copyright (C) 2016  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Microbenchmarks for the per-packet kernels in gdbstub_rsp.c.  Each
+ * kernel is timed across input sizes and byte distributions and reported
+ * in ns/byte, and in cycles/byte where a cycle counter is available.
+ *
+ *   codec_bench [filter]
+ *
+ * Only kernels whose name contains filter are run.  gdbstub_rsp.c is
+ * built into this file against the stand-in system layer below, so the
+ * packet builder's internals are reachable and nothing here touches a dump.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "../gdbstub_rsp.c"
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+#define MAX_SIZE    4096
+#define TARGET_BYTES (8 << 20)   /* Bytes processed per measurement */
+#define RUNS        3            /* Measurements per case, best is kept */
+
+/*****************************************************************************
+ * System layer for a target whose memory reads as zero
+ ****************************************************************************/
+
+int dbg_sys_getc(void) { return EOF; }
+int dbg_sys_peek(const char **buf) { return EOF; }
+void dbg_sys_consume(size_t len) { }
+int dbg_sys_putchar(int ch) { return ch; }
+int dbg_sys_write(const char *buf, size_t len) { return 0; }
+int dbg_sys_mem_readb(address addr, char *val) { *val = 0; return 0; }
+int dbg_sys_mem_writeb(address addr, char val) { return EOF; }
+uint8_t *dbg_sys_mem_page(address addr, int write) { return NULL; }
+void dbg_sys_mem_dirty(address addr, size_t len) { }
+int dbg_sys_continue(void) { return 0; }
+int dbg_sys_step(void) { return 0; }
+int dbg_sys_breakpoint(int type, address addr, int insert) { return EOF; }
+int dbg_sys_watchpoint(int type, address addr, size_t len, int insert) { return EOF; }
+const char *dbg_sys_memory_map(void) { return ""; }
+void dbg_sys_stats(FILE *fp) { }
+
+/*****************************************************************************
+ * Inputs
+ ****************************************************************************/
+
+typedef struct dist {
+	const char *name;
+	void (*fill)(char *buf, size_t len);
+} dist;
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static void fill_random(char *buf, size_t len)
+{
+	while (len--) {
+		*buf++ = rng();
+	}
+}
+
+/* Only the characters binary encoding has to escape */
+static void fill_escape(char *buf, size_t len)
+{
+	while (len--) {
+		*buf++ = "$#}*"[rng() & 3];
+	}
+}
+
+static void fill_zero(char *buf, size_t len)
+{
+	memset(buf, 0, len);
+}
+
+/* The SDK's heap poison word */
+static void fill_pattern(char *buf, size_t len)
+{
+	static const char word[4] = { 0xfe, 0xef, 0xef, 0xfe };
+	for (size_t i = 0; i < len; i++) {
+		buf[i] = word[i & 3];
+	}
+}
+
+static const dist dists[] = {
+	{ "random",  fill_random  },
+	{ "escape",  fill_escape  },
+	{ "zero",    fill_zero    },
+	{ "pattern", fill_pattern },
+};
+
+static const size_t sizes[] = { 16, 64, 256, 1024, 4096 };
+
+/*****************************************************************************
+ * Kernels
+ ****************************************************************************/
+
+/*
+ * Each kernel processes len bytes of the case's data, preparing whatever
+ * encoded form it needs once in setup.
+ */
+typedef struct bench_case {
+	char   data[MAX_SIZE];
+	char   enc[2 * MAX_SIZE + 4];
+	char   out[2 * MAX_SIZE];
+	size_t len;
+	size_t enc_len;
+} bench_case;
+
+typedef struct kernel {
+	const char *name;
+	void (*setup)(bench_case *c);
+	void (*run)(bench_case *c);
+} kernel;
+
+static volatile uint32_t sink;
+static dbg_tx tx;
+
+static void setup_hex(bench_case *c)
+{
+	c->enc_len = dbg_enc_hex(c->enc, sizeof(c->enc), c->data, c->len);
+}
+
+static void setup_bin(bench_case *c)
+{
+	c->enc_len = dbg_enc_bin(c->enc, sizeof(c->enc), c->data, c->len);
+}
+
+static void run_enc_hex(bench_case *c)
+{
+	sink += dbg_enc_hex(c->out, sizeof(c->out), c->data, c->len);
+}
+
+static void run_dec_hex(bench_case *c)
+{
+	sink += dbg_dec_hex(c->enc, c->enc_len, c->out, c->len);
+}
+
+static void run_enc_bin(bench_case *c)
+{
+	sink += dbg_enc_bin(c->out, sizeof(c->out), c->data, c->len);
+}
+
+static void run_dec_bin(bench_case *c)
+{
+	sink += dbg_dec_bin(c->enc, c->enc_len, c->out, c->len);
+}
+
+static void run_checksum(bench_case *c)
+{
+	sink += dbg_checksum(c->data, c->len);
+}
+
+static void run_crc32(bench_case *c)
+{
+	sink += dbg_crc32(0xffffffff, (const uint8_t *)c->data, c->len);
+}
+
+/* A pattern which never matches, so the whole buffer is scanned */
+static void run_memmem(bench_case *c)
+{
+	static const char pat[] = { 0x5a, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0xa5 };
+	sink += dbg_memmem(c->data, c->len, pat, sizeof(pat)) != NULL;
+}
+
+/*
+ * m replies: hex encoding, run-length encoding and checksum together, in
+ * as many packets as the data needs.
+ */
+static void run_tx_hex(bench_case *c)
+{
+	for (size_t pos = 0, n; pos < c->len; pos += n) {
+		n = c->len - pos < DBG_PKT_SIZE / 2 - 8 ? c->len - pos : DBG_PKT_SIZE / 2 - 8;
+		dbg_tx_begin(&tx);
+		sink += dbg_tx_hex(&tx, &c->data[pos], n);
+	}
+}
+
+/* x replies, each carrying as much as fits once escaped */
+static void run_tx_bin(bench_case *c)
+{
+	for (size_t pos = 0; pos < c->len; ) {
+		dbg_tx_begin(&tx);
+		pos += dbg_tx_bin(&tx, &c->data[pos], c->len - pos);
+	}
+}
+
+/* Incoming X packets, framed and escaped, parsed in one chunk */
+static void setup_rsp(bench_case *c)
+{
+	size_t len = dbg_enc_bin(&c->enc[1], sizeof(c->enc) - 4, c->data, c->len);
+	unsigned char csum = dbg_checksum(&c->enc[1], len);
+
+	c->enc[0] = '$';
+	c->enc[len + 1] = '#';
+	c->enc[len + 2] = digits[csum >> 4];
+	c->enc[len + 3] = digits[csum & 0xf];
+	c->enc_len = len + 4;
+}
+
+static int rsp_event(dbg_rsp *rsp, int event)
+{
+	sink += event + rsp->len;
+	return 0;
+}
+
+static void run_rsp_feed(bench_case *c)
+{
+	dbg_rsp rsp;
+
+	dbg_rsp_init(&rsp, c->out, sizeof(c->out), rsp_event, NULL);
+	dbg_rsp_feed(&rsp, c->enc, c->enc_len);
+}
+
+static const kernel kernels[] = {
+	{ "dbg_enc_hex",  NULL,      run_enc_hex  },
+	{ "dbg_dec_hex",  setup_hex, run_dec_hex  },
+	{ "dbg_enc_bin",  NULL,      run_enc_bin  },
+	{ "dbg_dec_bin",  setup_bin, run_dec_bin  },
+	{ "dbg_checksum", NULL,      run_checksum },
+	{ "dbg_crc32",    NULL,      run_crc32    },
+	{ "dbg_memmem",   NULL,      run_memmem   },
+	{ "dbg_tx_hex",   NULL,      run_tx_hex   },
+	{ "dbg_tx_bin",   NULL,      run_tx_bin   },
+	{ "dbg_rsp_feed", setup_rsp, run_rsp_feed },
+};
+
+/*****************************************************************************
+ * Timing
+ ****************************************************************************/
+
+static double now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_CYCLES
+	return __rdtsc();
+#else
+	return 0;
+#endif
+}
+
+/*
+ * Time iters calls of fn, keeping the best of RUNS measurements.
+ */
+static void measure(void (*fn)(bench_case *), bench_case *arg, unsigned long iters,
+                    double *best_ns, double *best_cyc)
+{
+	*best_ns = *best_cyc = 0;
+	for (int r = 0; r < RUNS; r++) {
+		double t = now_ns();
+		uint64_t c = cycles();
+		for (unsigned long i = 0; i < iters; i++) {
+			fn(arg);
+		}
+		c = cycles() - c;
+		t = now_ns() - t;
+		if (r == 0 || t < *best_ns) {
+			*best_ns = t;
+			*best_cyc = c;
+		}
+	}
+}
+
+static void bench_kernel(const kernel *k, bench_case *c)
+{
+	printf("%-14s", k->name);
+	for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+		printf(" %12zu", sizes[s]);
+	}
+	printf("\n");
+
+	for (size_t d = 0; d < sizeof(dists)/sizeof(dists[0]); d++) {
+		printf("  %-12s", dists[d].name);
+		for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]); s++) {
+			unsigned long iters = TARGET_BYTES / sizes[s];
+			double ns, cyc;
+
+			c->len = sizes[s];
+			dists[d].fill(c->data, c->len);
+			if (k->setup) {
+				k->setup(c);
+			}
+			measure(k->run, c, iters, &ns, &cyc);
+#ifdef HAVE_CYCLES
+			printf(" %5.2f/%5.2fc", ns / TARGET_BYTES, cyc / TARGET_BYTES);
+#else
+			printf(" %12.3f", ns / TARGET_BYTES);
+#endif
+		}
+		printf("\n");
+	}
+}
+
+/*
+ * The argument parsers are timed per call on typical packet arguments
+ * rather than per byte.
+ */
+static const char *parse_inputs[] = { "0", "40", "3ffe8000", "3fffffb0,800" };
+static const char *parse_arg;
+
+static void run_strtol(bench_case *unused)
+{
+	const char *end;
+	sink += dbg_strtol(parse_arg, strlen(parse_arg), 16, &end);
+}
+
+static void run_parse_hex(bench_case *unused)
+{
+	address val = 0;
+	dbg_parse_hex(parse_arg, parse_arg + strlen(parse_arg), &val);
+	sink += val;
+}
+
+static void bench_parse(const char *name, void (*run)(bench_case *))
+{
+	printf("%-14s %12s\n", name, "ns/call");
+	for (size_t i = 0; i < sizeof(parse_inputs)/sizeof(parse_inputs[0]); i++) {
+		unsigned long iters = TARGET_BYTES / 16;
+		double ns, cyc;
+
+		parse_arg = parse_inputs[i];
+		measure(run, NULL, iters, &ns, &cyc);
+		printf("  %-12s %12.2f", parse_arg, ns / iters);
+#ifdef HAVE_CYCLES
+		printf(" %8.1fc", cyc / iters);
+#endif
+		printf("\n");
+	}
+}
+
+/*****************************************************************************
+ * Main
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	const char *filter = argc > 1 ? argv[1] : "";
+	bench_case *c = (bench_case*)calloc(1, sizeof(bench_case));
+
+#ifdef HAVE_CYCLES
+	printf("ns/byte / cycles/byte (TSC), best of %d, by input size\n\n", RUNS);
+#else
+	printf("ns/byte, best of %d, by input size\n\n", RUNS);
+#endif
+	for (size_t k = 0; k < sizeof(kernels)/sizeof(kernels[0]); k++) {
+		if (strstr(kernels[k].name, filter)) {
+			bench_kernel(&kernels[k], c);
+		}
+	}
+	if (strstr("dbg_strtol", filter)) {
+		bench_parse("dbg_strtol", run_strtol);
+	}
+	if (strstr("dbg_parse_hex", filter)) {
+		bench_parse("dbg_parse_hex", run_parse_hex);
+	}
+	free(c);
+	return 0;
+}
@@ -0,0 +1,121 @@
+/*
+ * Copyright (C) 2016  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic crash log generator, for timing dbg_sys_load.  Writes a log in
+ * the same layout as the EspSaveCrash output the stub reads: a register
+ * block followed by a hex dump of all of RAM.
+ *
+ *   gen_crashlog [-s seed] [-z zero-percent] [-f fill-percent] out.log
+ *
+ * Each 4 KB page of RAM is zero with probability zero-percent, a repeated
+ * fill word with probability fill-percent, and random data otherwise, so
+ * both the shared page path and the private page path can be loaded.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#define RAMSTART 0x3ffe8000
+#define RAMLEN   0x18000
+#define PAGE     0x1000
+#define LINE     64
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned zero_pct = 25, fill_pct = 25;
+	uint32_t regs[23];
+	uint8_t *core;
+	FILE *fp;
+	int i;
+
+	for (i = 1; i < argc - 1; i++) {
+		if (!strcmp(argv[i], "-s")) {
+			rng_state = strtoull(argv[++i], NULL, 0) | 1;
+		} else if (!strcmp(argv[i], "-z")) {
+			zero_pct = strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-f")) {
+			fill_pct = strtoul(argv[++i], NULL, 0);
+		} else {
+			break;
+		}
+	}
+	if (i != argc - 1 || zero_pct + fill_pct > 100) {
+		fprintf(stderr, "usage: gen_crashlog [-s seed] [-z zero-percent] [-f fill-percent] out.log\n");
+		return 1;
+	}
+
+	core = (uint8_t*)malloc(RAMLEN);
+	for (uint32_t page = 0; page < RAMLEN; page += PAGE) {
+		unsigned pick = rng() % 100;
+		if (pick < zero_pct) {
+			memset(&core[page], 0, PAGE);
+		} else if (pick < zero_pct + fill_pct) {
+			/* The SDK's heap and stack poison words */
+			uint32_t word = (rng() & 1) ? 0xfeefeffe : 0xa5a5a5a5;
+			for (uint32_t off = 0; off < PAGE; off += 4) {
+				memcpy(&core[page + off], &word, 4);
+			}
+		} else {
+			for (uint32_t off = 0; off < PAGE; off++) {
+				core[page + off] = rng();
+			}
+		}
+	}
+
+	/* pc, ps, sar, vpri, a0..a15, litbase, sr176, sr208 */
+	memset(regs, 0, sizeof(regs));
+	regs[0] = 0x40201dc8;
+	regs[1] = 0x00000020;
+	regs[2] = 0x00000010;
+	for (i = 4; i < 20; i++) {
+		regs[i] = RAMSTART + (rng() % RAMLEN & ~3u);
+	}
+	regs[5] = RAMSTART + RAMLEN - 0x100;
+
+	fp = fopen(argv[argc - 1], "w");
+	if (!fp) {
+		perror(argv[argc - 1]);
+		return 1;
+	}
+	fprintf(fp, "\nUser exception (panic/abort/assert)\n\n");
+	fprintf(fp, "---- begin regs ----\n");
+	for (i = 0; i < 23; i++) {
+		fprintf(fp, "%08x\n", regs[i]);
+	}
+	fprintf(fp, "---- end regs ----\n\n");
+	fprintf(fp, "---- begin core ----\n");
+	for (uint32_t off = 0; off < RAMLEN; off++) {
+		fprintf(fp, "%02X%s", core[off], (off % LINE == LINE - 1) ? "\n" : "");
+	}
+	fprintf(fp, "---- end core ----\n");
+	free(core);
+	return fclose(fp) ? 1 : 0;
+}
@@ -0,0 +1,360 @@
+/*
+ * Copyright (C) 2016  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Synthetic RSP load generator.  Starts a stub with a socketpair for its
+ * stdin and stdout, plays the debugger's side with a weighted mix of
+ * requests and reports throughput and latency.
+ *
+ *   rsp_load [-n requests] [-m mix] [-s seed] -- stub [args...]
+ *
+ * A mix is a comma separated list of name=weight, where name is one of
+ * g, p, qSupported, m<size>, x<size> or X<size>.  Reads and writes go to
+ * random addresses in the dump's RAM.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define RAMSTART    0x3ffe8000
+#define RAMLEN      0x18000
+#define PKT_SIZE    0x1000
+#define MAX_OPS     32
+#define DEFAULT_MIX "g=10,p=20,qSupported=1,m16=20,m256=20,m1024=10,x2048=10,X256=10"
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+typedef struct op {
+	char     name[16];
+	char     kind;       /* g, p, q, m, x or X */
+	unsigned size;       /* bytes for memory operations */
+	unsigned weight;
+	unsigned long count;
+	double   total_us;
+} op;
+
+typedef struct conn {
+	int    fd;
+	char   buf[65536];
+	size_t pos;
+	size_t len;
+	uint64_t bytes_in;
+	uint64_t bytes_out;
+} conn;
+
+/*****************************************************************************
+ * Helpers
+ ****************************************************************************/
+
+static uint64_t rng_state = 0x9e3779b97f4a7c15ull;
+
+static uint64_t rng(void)
+{
+	rng_state ^= rng_state << 13;
+	rng_state ^= rng_state >> 7;
+	rng_state ^= rng_state << 17;
+	return rng_state;
+}
+
+static double now_us(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+	return (x > y) - (x < y);
+}
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "rsp_load: %s\n", msg);
+	exit(1);
+}
+
+/*****************************************************************************
+ * Connection
+ ****************************************************************************/
+
+static int conn_getc(conn *c)
+{
+	if (c->pos == c->len) {
+		ssize_t n = read(c->fd, c->buf, sizeof(c->buf));
+		if (n <= 0) {
+			return EOF;
+		}
+		c->pos = 0;
+		c->len = n;
+		c->bytes_in += n;
+	}
+	return (unsigned char)c->buf[c->pos++];
+}
+
+static void conn_write(conn *c, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(c->fd, data, len);
+		if (n <= 0) {
+			die("write to stub failed");
+		}
+		data += n;
+		len -= n;
+		c->bytes_out += n;
+	}
+}
+
+/*
+ * Send a request and wait for its acknowledgement and reply.
+ *
+ * Returns the length of the reply's packet data.
+ */
+static size_t transact(conn *c, const char *req, size_t req_len)
+{
+	static char frame[2 * PKT_SIZE];
+	unsigned char csum = 0;
+	size_t len = 0;
+	int ch;
+
+	frame[len++] = '$';
+	for (size_t i = 0; i < req_len; i++) {
+		frame[len++] = req[i];
+		csum += (unsigned char)req[i];
+	}
+	len += sprintf(&frame[len], "#%02x", csum);
+	conn_write(c, frame, len);
+
+	if ((ch = conn_getc(c)) != '+') {
+		die("request not acknowledged");
+	}
+	while ((ch = conn_getc(c)) != '$') {
+		if (ch == EOF) {
+			die("stub closed the connection");
+		}
+	}
+
+	/* Reply data up to '#', then the two checksum digits */
+	csum = 0;
+	len = 0;
+	while ((ch = conn_getc(c)) != '#') {
+		if (ch == EOF) {
+			die("stub closed the connection");
+		}
+		csum += ch;
+		len++;
+	}
+	char digits[3] = { conn_getc(c), conn_getc(c), 0 };
+	if (strtoul(digits, NULL, 16) != csum) {
+		die("bad reply checksum");
+	}
+	conn_write(c, "+", 1);
+	return len;
+}
+
+/*****************************************************************************
+ * Requests
+ ****************************************************************************/
+
+static int parse_mix(const char *spec, op *ops)
+{
+	char *copy = strdup(spec);
+	int n = 0;
+
+	for (char *tok = strtok(copy, ","); tok; tok = strtok(NULL, ",")) {
+		char *eq = strchr(tok, '=');
+		op *o = &ops[n];
+
+		if (n == MAX_OPS) {
+			die("too many operations in mix");
+		}
+		memset(o, 0, sizeof(*o));
+		o->weight = eq ? strtoul(eq + 1, NULL, 0) : 1;
+		if (eq) {
+			*eq = '\0';
+		}
+		snprintf(o->name, sizeof(o->name), "%s", tok);
+		if (!strcmp(tok, "g") || !strcmp(tok, "p")) {
+			o->kind = tok[0];
+		} else if (!strcmp(tok, "qSupported")) {
+			o->kind = 'q';
+		} else if (strchr("mxX", tok[0]) && tok[1]) {
+			o->kind = tok[0];
+			o->size = strtoul(&tok[1], NULL, 0);
+			if (!o->size || o->size > PKT_SIZE) {
+				die("memory operation size out of range");
+			}
+		} else {
+			die("unknown operation in mix");
+		}
+		n++;
+	}
+	free(copy);
+	return n;
+}
+
+/*
+ * Build the packet data for one request of the given kind.
+ *
+ * Returns its length.
+ */
+static size_t build(op *o, char *pkt)
+{
+	uint32_t addr = RAMSTART + (rng() % (RAMLEN - o->size));
+	size_t len;
+
+	switch (o->kind) {
+	case 'g':
+		return sprintf(pkt, "g");
+	case 'p':
+		return sprintf(pkt, "p%x", (unsigned)(rng() % 21));
+	case 'q':
+		return sprintf(pkt, "qSupported:multiprocess+;swbreak+;hwbreak+");
+	case 'm':
+	case 'x':
+		return sprintf(pkt, "%c%x,%x", o->kind, addr, o->size);
+	default:
+		/* X with random binary data, escaped */
+		len = sprintf(pkt, "X%x,%x:", addr, o->size);
+		for (unsigned i = 0; i < o->size; i++) {
+			char ch = rng();
+			if (ch == '$' || ch == '#' || ch == '}' || ch == '*') {
+				pkt[len++] = '}';
+				ch ^= 0x20;
+			}
+			pkt[len++] = ch;
+		}
+		return len;
+	}
+}
+
+/*****************************************************************************
+ * Main
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	const char *mix = DEFAULT_MIX;
+	unsigned long requests = 10000;
+	op ops[MAX_OPS];
+	int num_ops, i, sv[2];
+	unsigned total_weight = 0;
+	conn *c;
+	pid_t pid;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+		if (!strcmp(argv[i], "-n") && i+1 < argc) {
+			requests = strtoul(argv[++i], NULL, 0);
+		} else if (!strcmp(argv[i], "-m") && i+1 < argc) {
+			mix = argv[++i];
+		} else if (!strcmp(argv[i], "-s") && i+1 < argc) {
+			rng_state = strtoull(argv[++i], NULL, 0) | 1;
+		} else {
+			i = argc;
+		}
+	}
+	if (i+1 >= argc) {
+		fprintf(stderr, "usage: rsp_load [-n requests] [-m mix] [-s seed] -- stub [args...]\n"
+		                "default mix: " DEFAULT_MIX "\n");
+		return 1;
+	}
+	num_ops = parse_mix(mix, ops);
+	for (int n = 0; n < num_ops; n++) {
+		total_weight += ops[n].weight;
+	}
+	if (!total_weight) {
+		die("mix has no weight");
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		die("socketpair failed");
+	}
+	double start = now_us();
+	pid = fork();
+	if (pid == 0) {
+		dup2(sv[1], 0);
+		dup2(sv[1], 1);
+		close(sv[0]);
+		close(sv[1]);
+		execvp(argv[i+1], &argv[i+1]);
+		perror(argv[i+1]);
+		_exit(127);
+	}
+	close(sv[1]);
+	signal(SIGPIPE, SIG_IGN);
+
+	c = (conn*)calloc(1, sizeof(conn));
+	c->fd = sv[0];
+
+	/* The first reply includes loading the dump */
+	char *pkt = (char*)malloc(2 * PKT_SIZE);
+	size_t len = sprintf(pkt, "qSupported");
+	transact(c, pkt, len);
+	double startup = now_us() - start;
+
+	double *lat = (double*)malloc((requests ? requests : 1) * sizeof(double));
+	uint64_t in0 = c->bytes_in, out0 = c->bytes_out;
+	double t0 = now_us();
+	for (unsigned long r = 0; r < requests; r++) {
+		unsigned pick = rng() % total_weight;
+		op *o = ops;
+		while (pick >= o->weight) {
+			pick -= o->weight;
+			o++;
+		}
+		len = build(o, pkt);
+		double t = now_us();
+		transact(c, pkt, len);
+		lat[r] = now_us() - t;
+		o->count++;
+		o->total_us += lat[r];
+	}
+	double elapsed = (now_us() - t0) / 1e6;
+	uint64_t bytes = (c->bytes_in - in0) + (c->bytes_out - out0);
+
+	close(c->fd);
+	waitpid(pid, NULL, 0);
+
+	printf("startup:  %.2f ms to first reply\n", startup / 1e3);
+	if (!requests) {
+		return 0;
+	}
+	qsort(lat, requests, sizeof(double), cmp_double);
+	printf("requests: %lu in %.3f s, %.0f packets/s, %.2f MB/s (%.2f MB in, %.2f MB out)\n",
+	       requests, elapsed, requests / elapsed, bytes / elapsed / 1e6,
+	       (c->bytes_in - in0) / 1e6, (c->bytes_out - out0) / 1e6);
+	printf("latency:  p50 %.1f us, p99 %.1f us, max %.1f us\n",
+	       lat[requests / 2], lat[requests * 99 / 100], lat[requests - 1]);
+	for (int n = 0; n < num_ops; n++) {
+		if (ops[n].count) {
+			printf("  %-12s %8lu  mean %.1f us\n", ops[n].name, ops[n].count,
+			       ops[n].total_us / ops[n].count);
+		}
+	}
+	return 0;
+}
@@ -64,18 +64,99 @@
 #endif
 #endif
 
+/* Signal numbers as gdb expects them in stop replies */
+#define DBG_SIGINT  2
+#define DBG_SIGILL  4
+#define DBG_SIGTRAP 5
+#define DBG_SIGBUS  10
+#define DBG_SIGSEGV 11
+#define DBG_SIGSYS  12
+
+/* Breakpoint types, as bits so one address can hold both */
+#define DBG_BP_SW   1
+#define DBG_BP_HW   2
+
+/* Watchpoint types; an access watchpoint is both a read and a write one */
+#define DBG_WP_WRITE  4
+#define DBG_WP_READ   8
+#define DBG_WP_ACCESS (DBG_WP_WRITE | DBG_WP_READ)
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+/* Events reported by dbg_rsp_feed */
+enum {
+	DBG_RSP_PACKET,     /* Packet with a good checksum, in buf[0..len) */
+	DBG_RSP_BAD_PACKET, /* Packet with a bad checksum, or too big for buf */
+	DBG_RSP_ACK,        /* + */
+	DBG_RSP_NACK,       /* - */
+	DBG_RSP_INTERRUPT,  /* ^C between packets */
+};
+
+struct dbg_rsp;
+
+/* Returns nonzero to make dbg_rsp_feed stop after the current byte */
+typedef int (*dbg_rsp_handler)(struct dbg_rsp *rsp, int event);
+
+/*
+ * Incremental RSP parser.  Bytes arrive through dbg_rsp_feed in chunks of
+ * any size, split anywhere, and the handler is called for each packet, ack
+ * and interrupt as it completes.  Packet data stays in buf until the next
+ * packet starts.  Run-length encoding is expanded; binary escapes are left
+ * for the packet's decoder.
+ */
+typedef struct dbg_rsp {
+	char           *buf;
+	size_t          buf_size;
+	size_t          len;       /* Packet data so far */
+	int             state;     /* Where in a frame the parser is */
+	int             overflow;  /* The packet did not fit in buf */
+	unsigned char   csum;      /* Sum of the packet data as received */
+	unsigned char   expected;  /* Checksum from the frame's trailer */
+	dbg_rsp_handler handler;
+	void           *ctx;       /* For the handler */
+} dbg_rsp;
+
 /*****************************************************************************
  * Prototypes
  ****************************************************************************/
 
 int dbg_main(struct dbg_state *state);
 
+/* Incremental RSP parser (gdbstub_rsp.c) */
+void dbg_rsp_init(dbg_rsp *rsp, char *buf, size_t buf_size,
+                  dbg_rsp_handler handler, void *ctx);
+size_t dbg_rsp_feed(dbg_rsp *rsp, const char *data, size_t len);
+
+/* Protocol options, set before calling dbg_main */
+extern int dbg_use_rle;    /* Run-length encode replies */
+extern int dbg_use_tdesc;  /* Serve target.xml and number registers by it */
+
+/* Session recording and replay (gdbstub_rsp.c) */
+int dbg_record_start(const char *fname);
+int dbg_replay_start(const char *fname);
+int dbg_replaying(void);
+int dbg_replay_interrupt(void);
+int dbg_replay_finish(void);
+
+/* Packet statistics, also shown by "monitor stats" (gdbstub_rsp.c) */
+void dbg_stats_dump(void);
+int dbg_stats_first_packet(uint64_t *arrival, uint64_t *done);
+
 /* System functions, supported by all stubs */
 int dbg_sys_getc(void);
+int dbg_sys_peek(const char **buf);
+void dbg_sys_consume(size_t len);
 int dbg_sys_putchar(int ch);
+int dbg_sys_write(const char *buf, size_t len);
 int dbg_sys_mem_readb(address addr, char *val);
 int dbg_sys_mem_writeb(address addr, char val);
 int dbg_sys_continue();
 int dbg_sys_step();
+int dbg_sys_breakpoint(int type, address addr, int insert);
+int dbg_sys_watchpoint(int type, address addr, size_t len, int insert);
+const char *dbg_sys_memory_map(void);
+void dbg_sys_stats(FILE *fp);
 
 #endif
@@ -18,13 +18,35 @@
 
 #include "gdbstub.h"
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 /*****************************************************************************
  * Types
  ****************************************************************************/
 
+/* Largest packet, as advertised in qSupported's PacketSize (hex) */
+#define DBG_PKT_SIZE 0x1000
+
 typedef int (*dbg_enc_func)(char *buf, size_t buf_len, const char *data, size_t data_len);
 typedef int (*dbg_dec_func)(const char *buf, size_t buf_len, char *data, size_t data_len);
+typedef int (*dbg_dec_part_func)(const char *buf, size_t buf_len, char *data, size_t data_len);
+
+/*
+ * An outgoing packet, framed as $<packet-data>#<checksum>.  Data added to
+ * it is run-length encoded and summed on the way in, so each byte of a
+ * reply is touched once before the frame goes out in a single write.
+ */
+typedef struct dbg_tx {
+	char          buf[DBG_PKT_SIZE + 4];
+	size_t        len;
+	unsigned char csum;
+	char          run_ch;   /* Character of the pending run */
+	size_t        run_len;  /* Length of the pending run, 0 if none */
+} dbg_tx;
 
 /*****************************************************************************
  * Const Data
@@ -32,6 +54,13 @@ typedef int (*dbg_dec_func)(const char *buf, size_t buf_len, char *data, size_t
 
 const char digits[] = "0123456789abcdef";
 
+/*****************************************************************************
+ * Options
+ ****************************************************************************/
+
+int dbg_use_rle = 1;
+int dbg_use_tdesc = 0;
+
 /*****************************************************************************
  * Prototypes
  ****************************************************************************/
@@ -46,6 +75,7 @@ int dbg_is_printable_char(char ch);
 char dbg_get_digit(int val);
 int dbg_get_val(char digit, int base);
 int dbg_strtol(const char *str, size_t len, int base, const char **endptr);
+const char *dbg_parse_hex(const char *str, const char *end, address *val);
 
 /* Packet functions */
 int dbg_send_packet(const char *pkt, size_t pkt_len);
@@ -54,23 +84,46 @@ int dbg_recv_packet(char *pkt_buf, size_t pkt_buf_len, size_t *pkt_len);
 int dbg_checksum(const char *buf, size_t len);
 int dbg_recv_ack(void);
 
+/* Packet builder */
+void dbg_tx_begin(dbg_tx *tx);
+int dbg_tx_data(dbg_tx *tx, const char *data, size_t len);
+int dbg_tx_hex(dbg_tx *tx, const char *data, size_t len);
+size_t dbg_tx_bin(dbg_tx *tx, const char *data, size_t len);
+int dbg_tx_end(dbg_tx *tx);
+
 /* Data encoding/decoding */
 int dbg_enc_hex(char *buf, size_t buf_len, const char *data, size_t data_len);
 int dbg_dec_hex(const char *buf, size_t buf_len, char *data, size_t data_len);
 int dbg_enc_bin(char *buf, size_t buf_len, const char *data, size_t data_len);
 int dbg_dec_bin(const char *buf, size_t buf_len, char *data, size_t data_len);
+int dbg_dec_hex_part(const char *buf, size_t buf_len, char *data, size_t data_len);
+int dbg_dec_bin_part(const char *buf, size_t buf_len, char *data, size_t data_len);
 
 /* Packet creation helpers */
 int dbg_send_ok_packet(char *buf, size_t buf_len);
 int dbg_send_conmsg_packet(char *buf, size_t buf_len, const char *msg);
 int dbg_send_signal_packet(char *buf, size_t buf_len, char signal);
+int dbg_send_stop_packet(char *buf, size_t buf_len, struct dbg_state *state, char signal);
 int dbg_send_error_packet(char *buf, size_t buf_len, char error);
+int dbg_send_xfer_packet(char *buf, size_t buf_len, const char *obj, size_t obj_len, size_t offset, size_t len);
+int dbg_send_console(const char *msg, size_t len);
+
+/* CRC-32 as used by qCRC */
+uint32_t dbg_crc32(uint32_t crc, const uint8_t *buf, size_t len);
+
+/* Memory search */
+const char *dbg_memmem(const char *hay, size_t hay_len, const char *pat, size_t pat_len);
 
 /* Command functions */
-int dbg_mem_read(char *buf, size_t buf_len, address addr, size_t len, dbg_enc_func enc);
-int dbg_mem_write(const char *buf, size_t buf_len, address addr, size_t len, dbg_dec_func dec);
+int dbg_mem_read(dbg_tx *tx, address addr, size_t len);
+int dbg_mem_read_bin(dbg_tx *tx, address addr, size_t len);
+int dbg_mem_crc(address addr, size_t len, uint32_t *crc);
+int dbg_mem_copy(char *buf, address addr, size_t len);
+int dbg_mem_search(address addr, size_t len, const char *pat, size_t pat_len, address *found);
+int dbg_mem_write(const char *buf, size_t buf_len, address addr, size_t len, dbg_dec_part_func dec);
 int dbg_continue(void);
 int dbg_step(void);
+int dbg_monitor(const char *cmd);
 
 /*****************************************************************************
  * String Processing Helper Functions
@@ -198,6 +251,87 @@ int dbg_get_val(char digit, int base)
 	return (value < base) ? value : EOF;
 }
 
+/*
+ * Classify 8 characters, packed little-endian, as hex digits or not.
+ *
+ * Returns 0x80 in each byte holding a hex digit, and sets *nibbles to the
+ * value of every digit in its byte.
+ */
+static inline uint64_t dbg_hex_digits8(uint64_t x, uint64_t *nibbles)
+{
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t high = 0x8080808080808080ULL;
+	uint64_t low7  = x & ~high;
+	uint64_t lower = low7 | (0x20 * ones);  /* Folds A-F onto a-f */
+
+	/* Adding 0x80-c sets a byte's top bit when it is c or more */
+	uint64_t digit = ((low7 + (0x80 - '0') * ones) & ~(low7 + (0x80 - '9' - 1) * ones));
+	uint64_t alpha = ((lower + (0x80 - 'a') * ones) & ~(lower + (0x80 - 'f' - 1) * ones));
+	alpha &= high & ~x;
+
+	*nibbles = (x & (0x0f * ones)) + (alpha >> 7) * 9;
+	return (digit | alpha) & high & ~x;
+}
+
+/*
+ * Parse a hex number, such as an address or length argument in a packet,
+ * 8 characters at a time.  Unlike dbg_strtol there is no sign or 0x prefix,
+ * and the number ends at the first character that isn't a hex digit, or
+ * at end.
+ *
+ * Returns a pointer past the last digit, or NULL if there were none.
+ */
+const char *dbg_parse_hex(const char *str, const char *end, address *val)
+{
+	const char *start = str;
+	uint64_t value = 0;
+
+#if defined(__BYTE_ORDER__) && (__BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__)
+	while (str < end) {
+		uint64_t x = 0, v, hex;
+		size_t n = (end - str < 8) ? end - str : 8;
+		int digits;
+
+		/* Missing characters read as zero bytes, which aren't digits */
+		if (n == 8) {
+			memcpy(&x, str, 8);
+		} else {
+			for (size_t i = 0; i < n; i++) {
+				x |= (uint64_t)(uint8_t)str[i] << (8 * i);
+			}
+		}
+		hex = dbg_hex_digits8(x, &v);
+		digits = (~hex & 0x8080808080808080ULL) ?
+		         __builtin_ctzll(~hex & 0x8080808080808080ULL) / 8 : 8;
+		if (!digits) {
+			break;
+		}
+
+		/* Leading zeros for the missing digits, then pairs to bytes to words */
+		v <<= 8 * (8 - digits);
+		v = ((v << 4) + (v >> 8)) & 0x00ff00ff00ff00ffULL;
+		v = ((v << 8) + (v >> 16)) & 0x0000ffff0000ffffULL;
+		v = ((v << 16) | (v >> 32)) & 0xffffffffULL;
+
+		value = (value << (4 * digits)) | v;
+		str += digits;
+		if (digits < 8) {
+			break;
+		}
+	}
+#else
+	for (int tmp; str < end && (tmp = dbg_get_val(*str, 16)) != EOF; str++) {
+		value = (value << 4) | tmp;
+	}
+#endif
+
+	if (str == start) {
+		return NULL;
+	}
+	*val = value;
+	return str;
+}
+
 /*
  * Determine if this is a printable ASCII character.
  */
@@ -207,548 +341,2330 @@ int dbg_is_printable_char(char ch)
 }
 
 /*****************************************************************************
- * Packet Functions
+ * Session Recording
  ****************************************************************************/
 
 /*
- * Receive a packet acknowledgment
+ * A session file holds one entry per packet, as packet data without
+ * framing, in the order the packets went over the wire:
  *
- * Returns:
- *    0   if an ACK (+) was received
- *    1   if a NACK (-) was received
- *    EOF otherwise
+ *   <dir> <usec> <len>:<data>\n
+ *
+ * where dir is '<' for packets from the debugger and '>' for replies, and
+ * usec the time since the session started.  Replaying feeds the debugger's
+ * packets back to dbg_main as fast as it takes them and checks each reply
+ * against the recorded one.  Runs cut short with ^C can't be reproduced
+ * exactly: the replayed run stops at its first interrupt poll instead.
  */
-int dbg_recv_ack(void)
+typedef struct dbg_entry {
+	char   dir;
+	size_t len;
+	char   data[2 * DBG_PKT_SIZE];
+} dbg_entry;
+
+static FILE           *dbg_record_file;
+static FILE           *dbg_replay_file;
+static struct timespec dbg_session_start;
+static dbg_entry       dbg_replay_next;
+static int             dbg_replay_ahead;  /* dbg_replay_next is valid */
+static unsigned long   dbg_replay_packets;
+static unsigned long   dbg_replay_mismatches;
+
+static double dbg_session_elapsed(void)
 {
-	int response;
-
-	/* Wait for packet ack */
-	switch (response = dbg_sys_getc()) {
-	case '+':
-		/* Packet acknowledged */
-		return 0;
-	case '-':
-		/* Packet negative acknowledged */
-		return 1;
-	default:
-		/* Bad response! */
-		DEBUG_PRINT("received bad packet response: 0x%2x\n", response);
-		return EOF;
-	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - dbg_session_start.tv_sec) +
+	       (now.tv_nsec - dbg_session_start.tv_nsec) / 1e9;
 }
 
 /*
- * Calculate 8-bit checksum of a buffer.
+ * Undo run-length encoding of packet data.
  *
- * Returns:
- *    8-bit checksum.
+ * Returns the expanded length.
  */
-int dbg_checksum(const char *buf, size_t len)
+static size_t dbg_rle_expand(char *dst, const char *src, size_t len)
 {
-	unsigned char csum;
+	size_t out = 0;
 
-	csum = 0;
+	for (size_t pos = 0; pos < len; pos++) {
+		if (src[pos] == '*' && out && pos+1 < len) {
+			for (int n = src[++pos] - 29; n > 0; n--, out++) {
+				dst[out] = dst[out-1];
+			}
+		} else {
+			dst[out++] = src[pos];
+		}
+	}
+	return out;
+}
 
-	while (len--) {
-		csum += *buf++;
+/*
+ * Start recording packets to fname.
+ *
+ * Returns 0 on success, EOF if the file can't be created.
+ */
+int dbg_record_start(const char *fname)
+{
+	dbg_record_file = fopen(fname, "wb");
+	if (!dbg_record_file) {
+		return EOF;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &dbg_session_start);
+	return 0;
+}
 
-	return csum;
+static void dbg_record_packet(char dir, const char *data, size_t len)
+{
+	unsigned long long usec = dbg_session_elapsed() * 1e6;
+
+	fprintf(dbg_record_file, "%c %llu %zu:", dir, usec, len);
+	fwrite(data, 1, len, dbg_record_file);
+	fputc('\n', dbg_record_file);
+	fflush(dbg_record_file);
 }
 
 /*
- * Transmits a packet of data.
- * Packets are of the form: $<packet-data>#<checksum>
+ * Start replaying the session in fname instead of talking to a debugger.
  *
- * Returns:
- *    0   if the packet was transmitted and acknowledged
- *    1   if the packet was transmitted but not acknowledged
- *    EOF otherwise
+ * Returns 0 on success, EOF if the file can't be opened.
  */
-int dbg_send_packet(const char *pkt_data, size_t pkt_len)
+int dbg_replay_start(const char *fname)
 {
-	char buf[3];
-	char csum;
-
-	/* Send packet start */
-	if (dbg_sys_putchar('$') == EOF) {
+	dbg_replay_file = fopen(fname, "rb");
+	if (!dbg_replay_file) {
 		return EOF;
 	}
+	clock_gettime(CLOCK_MONOTONIC, &dbg_session_start);
+	return 0;
+}
 
-#if DEBUG
-	{
-		size_t p;
-		DEBUG_PRINT("-> ");
-		for (p = 0; p < pkt_len; p++) {
-			if (dbg_is_printable_char(pkt_data[p])) {
-				DEBUG_PRINT("%c", pkt_data[p]);
-			} else {
-				DEBUG_PRINT("\\x%02x", pkt_data[p]&0xff);
-			}
-		}
-		DEBUG_PRINT("\n");
+/*
+ * Look at the next entry without consuming it.
+ *
+ * Returns the entry, or NULL at the end of the session.
+ */
+static dbg_entry *dbg_replay_peek(void)
+{
+	dbg_entry *e = &dbg_replay_next;
+	unsigned long long usec;
+
+	if (dbg_replay_ahead) {
+		return e;
 	}
-#endif
+	if ((fscanf(dbg_replay_file, "%c %llu %zu:", &e->dir, &usec, &e->len) != 3) ||
+	    (e->len > sizeof(e->data)) ||
+	    (fread(e->data, 1, e->len, dbg_replay_file) != e->len) ||
+	    (fgetc(dbg_replay_file) != '\n')) {
+		return NULL;
+	}
+	dbg_replay_ahead = 1;
+	return e;
+}
+
+static void dbg_replay_mismatch(const char *what, const char *data, size_t len)
+{
+	dbg_replay_mismatches++;
+	fprintf(stderr, "replay: packet %lu: %s: %.*s\n", dbg_replay_packets,
+	        what, (int)(len > 80 ? 80 : len), data);
+}
+
+static int dbg_replay_recv(char *pkt_buf, size_t pkt_buf_len, size_t *pkt_len)
+{
+	dbg_entry *e;
 
-	/* Send packet data */
-	if (dbg_write(pkt_data, pkt_len) == EOF) {
+	while ((e = dbg_replay_peek()) && (e->dir != '<')) {
+		dbg_replay_mismatch("reply not sent", e->data, e->len);
+		dbg_replay_ahead = 0;
+	}
+	if (!e || (e->len > pkt_buf_len)) {
 		return EOF;
 	}
+	memcpy(pkt_buf, e->data, e->len);
+	*pkt_len = e->len;
+	dbg_replay_ahead = 0;
+	dbg_replay_packets++;
+	return 0;
+}
 
-	/* Send the checksum */
-	buf[0] = '#';
-	csum = dbg_checksum(pkt_data, pkt_len);
-	if ((dbg_enc_hex(buf+1, sizeof(buf)-1, &csum, 1) == EOF) ||
-		(dbg_write(buf, sizeof(buf)) == EOF)) {
-		return EOF;
+static void dbg_replay_send(const char *data, size_t len)
+{
+	dbg_entry *e = dbg_replay_peek();
+
+	if (!e || (e->dir != '>')) {
+		dbg_replay_mismatch("unexpected reply", data, len);
+		return;
+	}
+	if ((e->len != len) || memcmp(e->data, data, len)) {
+		dbg_replay_mismatch("reply differs", data, len);
 	}
+	dbg_replay_ahead = 0;
+	dbg_replay_packets++;
+}
 
-	return dbg_recv_ack();
+/*
+ * While replaying, a run stops when the recording says it was interrupted.
+ */
+int dbg_replay_interrupt(void)
+{
+	dbg_entry *e = dbg_replay_peek();
+	return e && (e->dir == '>') && (e->len >= 3) &&
+	       (e->data[0] == 'S' || e->data[0] == 'T') &&
+	       (e->data[1] == '0') && (e->data[2] == '2');
 }
 
-int dbg_send_packet_string(const char *str) {
-	return dbg_send_packet(str, strlen(str));
+int dbg_replaying(void)
+{
+	return dbg_replay_file != NULL;
 }
 
 /*
- * Receives a packet of data, assuming a 7-bit clean connection.
+ * Report on a finished replay.
  *
- * Returns:
- *    0   if the packet was received
- *    EOF otherwise
+ * Returns 0 if every reply matched, 1 otherwise.
  */
-int dbg_recv_packet(char *pkt_buf, size_t pkt_buf_len, size_t *pkt_len)
+int dbg_replay_finish(void)
 {
-	int data;
-	char expected_csum, actual_csum;
-	char buf[2];
+	double elapsed = dbg_session_elapsed();
 
-	/* Wait for packet start */
-	actual_csum = 0;
+	fprintf(stderr, "replay: %lu packets in %.3f s (%.0f packets/s), %lu mismatches\n",
+	        dbg_replay_packets, elapsed,
+	        elapsed > 0 ? dbg_replay_packets / elapsed : 0.0,
+	        dbg_replay_mismatches);
+	return dbg_replay_mismatches ? 1 : 0;
+}
 
-	while (1) {
-		data = dbg_sys_getc();
-		if (data == '$') {
-			/* Detected start of packet. */
-			break;
-		}
-	}
+/*****************************************************************************
+ * Statistics
+ ****************************************************************************/
 
-	/* Read until checksum */
-	*pkt_len = 0;
-	while (1) {
-		data = dbg_sys_getc();
+/*
+ * Counts, bytes and service times per packet type, always collected.  A
+ * type is the command letter, or for q and Q packets the query name up to
+ * its first argument.  Service time runs from a packet's arrival to the
+ * end of its handling, and is bucketed by powers of two of microseconds:
+ * bucket 0 holds times under 1 us, bucket n times from 2^(n-1) us up.
+ */
+#define DBG_STATS_BUCKETS 24
+#define DBG_STATS_QUERIES 32
+
+typedef struct dbg_stat {
+	char          name[24];
+	unsigned long count;
+	uint64_t      bytes_in;
+	uint64_t      bytes_out;
+	uint64_t      total_ns;
+	uint64_t      max_ns;
+	unsigned long hist[DBG_STATS_BUCKETS];
+} dbg_stat;
+
+static dbg_stat  dbg_stats_cmd[128];
+static dbg_stat  dbg_stats_query[DBG_STATS_QUERIES];  /* Last one for overflow */
+static uint64_t  dbg_stats_tx_bytes;  /* Counted by dbg_tx_end */
+static dbg_stat *dbg_stats_cur;       /* Packet being handled */
+static uint64_t  dbg_stats_cur_start;
+static uint64_t  dbg_stats_cur_tx;
+static size_t    dbg_stats_cur_in;
+static uint64_t  dbg_stats_first_start;  /* First packet, 0 until handled */
+static uint64_t  dbg_stats_first_done;
+
+static uint64_t dbg_now_ns(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
 
-		if (data == EOF) {
-			/* Error receiving character */
-			return EOF;
-		} else if (data == '#') {
-			/* End of packet */
-			break;
-		} else {
-			/* Check for space */
-			if (*pkt_len >= pkt_buf_len) {
-				DEBUG_PRINT("packet buffer overflow\n");
-				return EOF;
-			}
+static dbg_stat *dbg_stats_lookup(const char *pkt, size_t len)
+{
+	dbg_stat *stat;
+	size_t n;
 
-			/* Store character and update checksum */
-			pkt_buf[(*pkt_len)++] = (char) data;
-		}
+	if (pkt[0] != 'q' && pkt[0] != 'Q') {
+		stat = &dbg_stats_cmd[pkt[0] & 0x7f];
+		stat->name[0] = pkt[0];
+		return stat;
 	}
 
-#if DEBUG
-	{
-		size_t p;
-		DEBUG_PRINT("<- ");
-		for (p = 0; p < *pkt_len; p++) {
-			if (dbg_is_printable_char(pkt_buf[p])) {
-				DEBUG_PRINT("%c", pkt_buf[p]);
-			} else {
-				DEBUG_PRINT("\\x%02x", pkt_buf[p] & 0xff);
-			}
+	for (n = 0; n < len && n < sizeof(stat->name) - 1; n++) {
+		if (pkt[n] == ':' || pkt[n] == ',' || pkt[n] == ';') {
+			break;
 		}
-		DEBUG_PRINT("\n");
-	}
-#endif
-
-	/* Receive the checksum */
-	if ((dbg_read(buf, sizeof(buf), 2) == EOF) ||
-		(dbg_dec_hex(buf, 2, &expected_csum, 1) == EOF)) {
-		return EOF;
 	}
-
-	/* Verify checksum */
-	actual_csum = dbg_checksum(pkt_buf, *pkt_len);
-	if (actual_csum != expected_csum) {
-		/* Send packet nack */
-		DEBUG_PRINT("received packet with bad checksum\n");
-		dbg_sys_putchar('-');
-		return EOF;
+	for (stat = dbg_stats_query; stat < &dbg_stats_query[DBG_STATS_QUERIES-1]; stat++) {
+		if (!stat->count) {
+			memcpy(stat->name, pkt, n);
+			stat->name[n] = '\0';
+			return stat;
+		}
+		if (!strncmp(stat->name, pkt, n) && stat->name[n] == '\0') {
+			return stat;
+		}
 	}
-
-	/* Send packet ack */
-	dbg_sys_putchar('+');
-	return 0;
+	strcpy(stat->name, "q(other)");
+	return stat;
 }
 
-/*****************************************************************************
- * Data Encoding/Decoding
- ****************************************************************************/
+/*
+ * Start accounting for a packet just received.
+ */
+static void dbg_stats_begin(const char *pkt, size_t len)
+{
+	dbg_stats_cur       = dbg_stats_lookup(pkt, len);
+	dbg_stats_cur_start = dbg_now_ns();
+	dbg_stats_cur_tx    = dbg_stats_tx_bytes;
+	dbg_stats_cur_in    = len + 4;  /* $, # and the checksum */
+}
 
 /*
- * Encode data to its hex-value representation in a buffer.
- *
- * Returns:
- *    0+  number of bytes written to buf
- *    EOF if the buffer is too small
+ * Finish accounting for the packet being handled, if any.
  */
-int dbg_enc_hex(char *buf, size_t buf_len, const char *data, size_t data_len)
+static void dbg_stats_end(void)
 {
-	size_t pos;
+	dbg_stat *stat = dbg_stats_cur;
+	uint64_t ns, us;
+	int bucket;
 
-	if (buf_len < data_len*2) {
-		/* Buffer too small */
-		return EOF;
+	if (!stat) {
+		return;
+	}
+	ns = dbg_now_ns() - dbg_stats_cur_start;
+	for (bucket = 0, us = ns / 1000; us && bucket < DBG_STATS_BUCKETS-1; us >>= 1) {
+		bucket++;
+	}
+	stat->count     += 1;
+	stat->bytes_in  += dbg_stats_cur_in;
+	stat->bytes_out += dbg_stats_tx_bytes - dbg_stats_cur_tx;
+	stat->total_ns  += ns;
+	stat->hist[bucket] += 1;
+	if (ns > stat->max_ns) {
+		stat->max_ns = ns;
 	}
+	if (!dbg_stats_first_done) {
+		dbg_stats_first_start = dbg_stats_cur_start;
+		dbg_stats_first_done  = dbg_stats_cur_start + ns;
+	}
+	dbg_stats_cur = NULL;
+}
 
-	for (pos = 0; pos < data_len; pos++) {
-		*buf++ = dbg_get_digit((data[pos] >> 4) & 0xf);
-		*buf++ = dbg_get_digit((data[pos]     ) & 0xf);
+static void dbg_stats_write_one(FILE *fp, const dbg_stat *stat)
+{
+	if (!stat->count) {
+		return;
+	}
+	fprintf(fp, "%-20s %8lu %10llu %10llu %10.1f %10.1f  ", stat->name, stat->count,
+	        (unsigned long long)stat->bytes_in, (unsigned long long)stat->bytes_out,
+	        stat->total_ns / 1e3 / stat->count, stat->max_ns / 1e3);
+	for (int i = 0; i < DBG_STATS_BUCKETS; i++) {
+		if (!stat->hist[i]) {
+			continue;
+		}
+		if (i == 0) {
+			fprintf(fp, " <1:%lu", stat->hist[i]);
+		} else {
+			fprintf(fp, " %lu:%lu", 1ul << (i-1), stat->hist[i]);
+		}
 	}
+	fprintf(fp, "\n");
+}
 
-	return data_len*2;
+static void dbg_stats_write(FILE *fp)
+{
+	fprintf(fp, "%-20s %8s %10s %10s %10s %10s   %s\n", "packet", "count",
+	        "bytes in", "bytes out", "mean us", "max us", "histogram (us:count)");
+	for (size_t i = 0; i < sizeof(dbg_stats_cmd)/sizeof(dbg_stats_cmd[0]); i++) {
+		dbg_stats_write_one(fp, &dbg_stats_cmd[i]);
+	}
+	for (size_t i = 0; i < DBG_STATS_QUERIES; i++) {
+		dbg_stats_write_one(fp, &dbg_stats_query[i]);
+	}
+	dbg_sys_stats(fp);
 }
 
 /*
- * Decode data from its hex-value representation to a buffer.
+ * Get when the first packet arrived and when it had been handled, in
+ * CLOCK_MONOTONIC nanoseconds.
  *
  * Returns:
  *    0   if successful
- *    EOF if the buffer is too small
+ *    EOF if no packet has been handled yet
  */
-int dbg_dec_hex(const char *buf, size_t buf_len, char *data, size_t data_len)
+int dbg_stats_first_packet(uint64_t *arrival, uint64_t *done)
 {
-	size_t pos;
-	int tmp;
-
-	if (buf_len != data_len*2) {
-		/* Buffer too small */
+	if (!dbg_stats_first_done) {
 		return EOF;
 	}
+	*arrival = dbg_stats_first_start;
+	*done = dbg_stats_first_done;
+	return 0;
+}
 
-	for (pos = 0; pos < data_len; pos++) {
-		/* Decode high nibble */
-		tmp = dbg_get_val(*buf++, 16);
-		if (tmp == EOF) {
-			/* Buffer contained junk. */
-			ASSERT(0);
-			return EOF;
-		}
+/*
+ * Print packet statistics to stderr.
+ */
+void dbg_stats_dump(void)
+{
+	dbg_stats_write(stderr);
+	fflush(stderr);
+}
 
-		data[pos] = tmp << 4;
+/*****************************************************************************
+ * Packet Parser
+ ****************************************************************************/
 
-		/* Decode low nibble */
-		tmp = dbg_get_val(*buf++, 16);
-		if (tmp == EOF) {
-			/* Buffer contained junk. */
-			ASSERT(0);
-			return EOF;
-		}
-		data[pos] |= tmp;
-	}
+/* Parser states */
+enum {
+	DBG_RSP_IDLE,    /* Between packets */
+	DBG_RSP_DATA,    /* In packet data */
+	DBG_RSP_ESCAPE,  /* After a }, so the next character is data */
+	DBG_RSP_REPEAT,  /* After a *, waiting for the repeat count */
+	DBG_RSP_CSUM1,   /* After the #, waiting for the checksum digits */
+	DBG_RSP_CSUM2,
+};
+
+/* Characters which end a run of plain packet data */
+static const unsigned char dbg_rsp_special[256] = {
+	['#'] = 1, ['$'] = 1, ['*'] = 1, ['}'] = 1,
+};
 
-	return 0;
+/*
+ * Start parsing, with packet data going to buf.
+ */
+void dbg_rsp_init(dbg_rsp *rsp, char *buf, size_t buf_size,
+                  dbg_rsp_handler handler, void *ctx)
+{
+	memset(rsp, 0, sizeof(*rsp));
+	rsp->buf = buf;
+	rsp->buf_size = buf_size;
+	rsp->handler = handler;
+	rsp->ctx = ctx;
+	rsp->state = DBG_RSP_IDLE;
+}
+
+static void dbg_rsp_put(dbg_rsp *rsp, char ch, size_t count)
+{
+	if (rsp->buf_size - rsp->len < count) {
+		rsp->overflow = 1;
+		return;
+	}
+	memset(&rsp->buf[rsp->len], ch, count);
+	rsp->len += count;
 }
 
 /*
- * Encode data to its binary representation in a buffer.
+ * Parse len bytes of data from the debugger.
  *
- * Returns:
+ * Returns the number of bytes consumed, which is less than len only if the
+ * handler asked to stop.
+ */
+size_t dbg_rsp_feed(dbg_rsp *rsp, const char *data, size_t len)
+{
+	const char *pos = data, *end = data + len;
+	int event, val;
+	char ch;
+
+	while (pos < end) {
+		if (rsp->state == DBG_RSP_DATA) {
+			/* Copy the run of plain data up to the next special character */
+			const char *run = pos;
+			while ((pos < end) && !dbg_rsp_special[(unsigned char)*pos]) {
+				pos++;
+			}
+			if (pos > run) {
+				size_t n = pos - run;
+				rsp->csum += dbg_checksum(run, n);
+				if (rsp->buf_size - rsp->len < n) {
+					rsp->overflow = 1;
+				} else {
+					memcpy(&rsp->buf[rsp->len], run, n);
+					rsp->len += n;
+				}
+				continue;
+			}
+		}
+
+		ch = *pos++;
+		event = -1;
+		switch (rsp->state) {
+		case DBG_RSP_IDLE:
+			if (ch == '$') {
+				rsp->state = DBG_RSP_DATA;
+				rsp->len = 0;
+				rsp->csum = 0;
+				rsp->expected = 0;
+				rsp->overflow = 0;
+			} else if (ch == '+') {
+				event = DBG_RSP_ACK;
+			} else if (ch == '-') {
+				event = DBG_RSP_NACK;
+			} else if (ch == 0x03) {
+				event = DBG_RSP_INTERRUPT;
+			}
+			break;
+
+		case DBG_RSP_DATA:
+			if (ch == '#') {
+				rsp->state = DBG_RSP_CSUM1;
+				break;
+			}
+			if (ch == '$') {
+				/* The rest of the last packet was lost, start over */
+				rsp->len = 0;
+				rsp->csum = 0;
+				rsp->overflow = 0;
+				break;
+			}
+			rsp->csum += ch;
+			if ((ch == '*') && rsp->len) {
+				rsp->state = DBG_RSP_REPEAT;
+				break;
+			}
+			dbg_rsp_put(rsp, ch, 1);
+			if (ch == '}') {
+				rsp->state = DBG_RSP_ESCAPE;
+			}
+			break;
+
+		case DBG_RSP_ESCAPE:
+			if (ch == '#') {
+				rsp->state = DBG_RSP_CSUM1;
+				break;
+			}
+			rsp->csum += ch;
+			dbg_rsp_put(rsp, ch, 1);
+			rsp->state = DBG_RSP_DATA;
+			break;
+
+		case DBG_RSP_REPEAT:
+			/* The count is 29 more than the extra copies of the last character */
+			rsp->csum += ch;
+			if ((unsigned char)ch < 29 + 3 || (unsigned char)ch > 126) {
+				rsp->overflow = 1;
+			} else {
+				dbg_rsp_put(rsp, rsp->buf[rsp->len - 1], (unsigned char)ch - 29);
+			}
+			rsp->state = DBG_RSP_DATA;
+			break;
+
+		case DBG_RSP_CSUM1:
+		case DBG_RSP_CSUM2:
+			val = dbg_get_val(ch, 16);
+			if (val < 0) {
+				rsp->overflow = 1;
+				val = 0;
+			}
+			rsp->expected = (rsp->expected << 4) | val;
+			if (rsp->state == DBG_RSP_CSUM1) {
+				rsp->state = DBG_RSP_CSUM2;
+				break;
+			}
+			event = (rsp->overflow || rsp->csum != rsp->expected) ?
+			        DBG_RSP_BAD_PACKET : DBG_RSP_PACKET;
+			break;
+		}
+
+		if (event >= 0) {
+			rsp->state = DBG_RSP_IDLE;
+			if (rsp->handler(rsp, event)) {
+				break;
+			}
+		}
+	}
+	return pos - data;
+}
+
+/*****************************************************************************
+ * Packet Functions
+ ****************************************************************************/
+
+/*
+ * Receive a packet acknowledgment
+ *
+ * Returns:
+ *    0   if an ACK (+) was received
+ *    1   if a NACK (-) was received
+ *    EOF otherwise
+ */
+int dbg_recv_ack(void)
+{
+	int response;
+
+	/* Wait for packet ack */
+	switch (response = dbg_sys_getc()) {
+	case '+':
+		/* Packet acknowledged */
+		return 0;
+	case '-':
+		/* Packet negative acknowledged */
+		return 1;
+	default:
+		/* Bad response! */
+		DEBUG_PRINT("received bad packet response: 0x%2x\n", response);
+		return EOF;
+	}
+}
+
+/*
+ * Calculate 8-bit checksum of a buffer.  With SSE2, 16 bytes at a time
+ * are summed horizontally with PSADBW against zero.
+ *
+ * Returns:
+ *    8-bit checksum.
+ */
+int dbg_checksum(const char *buf, size_t len)
+{
+	unsigned char csum;
+
+	csum = 0;
+
+#ifdef __SSE2__
+	{
+		__m128i sum = _mm_setzero_si128();
+		for (; len >= 16; len -= 16, buf += 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)buf);
+			sum = _mm_add_epi64(sum, _mm_sad_epu8(v, _mm_setzero_si128()));
+		}
+		csum = _mm_cvtsi128_si32(sum) +
+		       _mm_cvtsi128_si32(_mm_unpackhi_epi64(sum, sum));
+	}
+#endif
+
+	while (len--) {
+		csum += *buf++;
+	}
+
+	return csum;
+}
+
+/*
+ * Transmits a packet of data.
+ * Packets are of the form: $<packet-data>#<checksum>
+ *
+ * Returns:
+ *    0   if the packet was transmitted and acknowledged
+ *    1   if the packet was transmitted but not acknowledged
+ *    EOF otherwise
+ */
+int dbg_send_packet(const char *pkt_data, size_t pkt_len)
+{
+	dbg_tx tx;
+
+	dbg_tx_begin(&tx);
+	if (dbg_tx_data(&tx, pkt_data, pkt_len) == EOF) {
+		return EOF;
+	}
+	return dbg_tx_end(&tx);
+}
+
+int dbg_send_packet_string(const char *str) {
+	return dbg_send_packet(str, strlen(str));
+}
+
+/*
+ * Parser handler for the blocking receive functions: note the event and
+ * stop, so bytes after it stay with the debugging stream.
+ */
+static int dbg_recv_event(dbg_rsp *rsp, int event)
+{
+	*(int *)rsp->ctx = event;
+	return 1;
+}
+
+/*
+ * Receives a packet of data, assuming a 7-bit clean connection.  Whatever
+ * the transport has buffered is pushed through the parser in one go until
+ * it completes a good packet; bad ones are nacked and the wait goes on.
+ * Bytes after the packet stay buffered for the next read.
+ *
+ * Returns:
+ *    0   if the packet was received
+ *    EOF otherwise
+ */
+int dbg_recv_packet(char *pkt_buf, size_t pkt_buf_len, size_t *pkt_len)
+{
+	dbg_rsp rsp;
+	const char *data;
+	int len, event;
+
+	if (dbg_replay_file) {
+		return dbg_replay_recv(pkt_buf, pkt_buf_len, pkt_len);
+	}
+
+	dbg_rsp_init(&rsp, pkt_buf, pkt_buf_len, dbg_recv_event, &event);
+	while (1) {
+		len = dbg_sys_peek(&data);
+		if (len == EOF) {
+			/* Debugger went away */
+			return EOF;
+		}
+		event = EOF;
+		dbg_sys_consume(dbg_rsp_feed(&rsp, data, len));
+		if (event == DBG_RSP_PACKET) {
+			break;
+		} else if (event == DBG_RSP_BAD_PACKET) {
+			/* Send packet nack */
+			DEBUG_PRINT("received packet with bad checksum or too long\n");
+			dbg_sys_putchar('-');
+		}
+	}
+	*pkt_len = rsp.len;
+
+#if DEBUG
+	{
+		size_t p;
+		DEBUG_PRINT("<- ");
+		for (p = 0; p < *pkt_len; p++) {
+			if (dbg_is_printable_char(pkt_buf[p])) {
+				DEBUG_PRINT("%c", pkt_buf[p]);
+			} else {
+				DEBUG_PRINT("\\x%02x", pkt_buf[p] & 0xff);
+			}
+		}
+		DEBUG_PRINT("\n");
+	}
+#endif
+
+	/* Send packet ack */
+	dbg_sys_putchar('+');
+
+	if (dbg_record_file) {
+		dbg_record_packet('<', pkt_buf, *pkt_len);
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Packet Builder
+ ****************************************************************************/
+
+/*
+ * Start a new packet.
+ */
+void dbg_tx_begin(dbg_tx *tx)
+{
+	tx->buf[0] = '$';
+	tx->len = 1;
+	tx->csum = 0;
+	tx->run_len = 0;
+}
+
+static inline void dbg_tx_emit(dbg_tx *tx, char ch)
+{
+	tx->buf[tx->len++] = ch;
+	tx->csum += ch;
+}
+
+/*
+ * Emit the pending run: its character followed by '*' and a printable
+ * count of further repeats, plus 29.  Short runs, where that would not be
+ * shorter, go out as they are, and counts of 6 and 7, which would appear
+ * as '#' and '$', are split.
+ */
+static void dbg_tx_flush_run(dbg_tx *tx)
+{
+	size_t rep, raw;
+
+	if (!tx->run_len) {
+		return;
+	}
+
+	/* Repeats to encode, and ones left over to send as they are */
+	rep = tx->run_len - 1;
+	raw = 0;
+	if (rep < 3) {
+		raw = rep;
+		rep = 0;
+	} else if (rep == 6 || rep == 7) {
+		raw = rep - 5;
+		rep = 5;
+	}
+
+	dbg_tx_emit(tx, tx->run_ch);
+	if (rep) {
+		dbg_tx_emit(tx, '*');
+		dbg_tx_emit(tx, rep + 29);
+	}
+	while (raw--) {
+		dbg_tx_emit(tx, tx->run_ch);
+	}
+	tx->run_len = 0;
+}
+
+/*
+ * Add one character, extending the pending run if it repeats.  Runs stop
+ * at the 97 repeats '~' can encode.
+ */
+static inline void dbg_tx_putc(dbg_tx *tx, char ch)
+{
+	if (!dbg_use_rle) {
+		dbg_tx_emit(tx, ch);
+	} else if (tx->run_len && tx->run_ch == ch && tx->run_len < 98) {
+		tx->run_len++;
+	} else {
+		dbg_tx_flush_run(tx);
+		tx->run_ch = ch;
+		tx->run_len = 1;
+	}
+}
+
+/*
+ * Space left for packet data, assuming nothing more compresses.  The
+ * pending run may still need all of its characters.
+ */
+static inline size_t dbg_tx_space(dbg_tx *tx)
+{
+	return DBG_PKT_SIZE + 1 - tx->len - tx->run_len;
+}
+
+/*
+ * Add data as it is.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the packet is full
+ */
+int dbg_tx_data(dbg_tx *tx, const char *data, size_t len)
+{
+	if (len > dbg_tx_space(tx)) {
+		return EOF;
+	}
+	while (len--) {
+		dbg_tx_putc(tx, *data++);
+	}
+	return 0;
+}
+
+/*
+ * Add data in its hex representation.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the packet is full
+ */
+int dbg_tx_hex(dbg_tx *tx, const char *data, size_t len)
+{
+	if (len > dbg_tx_space(tx) / 2) {
+		return EOF;
+	}
+	while (len--) {
+		dbg_tx_putc(tx, digits[(*data >> 4) & 0xf]);
+		dbg_tx_putc(tx, digits[*data & 0xf]);
+		data++;
+	}
+	return 0;
+}
+
+/*
+ * Add data in its binary representation, escaping as needed.  Stops at
+ * the first byte that doesn't fit.
+ *
+ * Returns the number of bytes of data added.
+ */
+size_t dbg_tx_bin(dbg_tx *tx, const char *data, size_t len)
+{
+	size_t space = dbg_tx_space(tx);
+	size_t pos;
+
+	for (pos = 0; pos < len; pos++) {
+		char ch = data[pos];
+		if (ch == '$' || ch == '#' || ch == '}' || ch == '*') {
+			if (space < 2) {
+				break;
+			}
+			dbg_tx_putc(tx, '}');
+			dbg_tx_putc(tx, ch ^ 0x20);
+			space -= 2;
+		} else {
+			if (space < 1) {
+				break;
+			}
+			dbg_tx_putc(tx, ch);
+			space -= 1;
+		}
+	}
+	return pos;
+}
+
+/*
+ * Finish the packet with its checksum, send it and wait for the ack.
+ *
+ * Returns:
+ *    0   if the packet was transmitted and acknowledged
+ *    1   if the packet was transmitted but not acknowledged
+ *    EOF otherwise
+ */
+int dbg_tx_end(dbg_tx *tx)
+{
+	dbg_tx_flush_run(tx);
+	tx->buf[tx->len++] = '#';
+	tx->buf[tx->len++] = digits[tx->csum >> 4];
+	tx->buf[tx->len++] = digits[tx->csum & 0xf];
+	dbg_stats_tx_bytes += tx->len;
+
+#if DEBUG
+	{
+		size_t p;
+		DEBUG_PRINT("-> ");
+		for (p = 0; p < tx->len; p++) {
+			if (dbg_is_printable_char(tx->buf[p])) {
+				DEBUG_PRINT("%c", tx->buf[p]);
+			} else {
+				DEBUG_PRINT("\\x%02x", tx->buf[p]&0xff);
+			}
+		}
+		DEBUG_PRINT("\n");
+	}
+#endif
+
+	if (dbg_record_file || dbg_replay_file) {
+		/* Sessions hold packet data as it was before run-length encoding */
+		char data[2 * DBG_PKT_SIZE];
+		size_t len = dbg_rle_expand(data, &tx->buf[1], tx->len - 4);
+		if (dbg_record_file) {
+			dbg_record_packet('>', data, len);
+		}
+		if (dbg_replay_file) {
+			dbg_replay_send(data, len);
+			return 0;
+		}
+	}
+
+	if (dbg_write(tx->buf, tx->len) == EOF) {
+		return EOF;
+	}
+
+	return dbg_recv_ack();
+}
+
+/*****************************************************************************
+ * Data Encoding/Decoding
+ ****************************************************************************/
+
+/*
+ * Encode data to its hex-value representation in a buffer.
+ *
+ * Returns:
  *    0+  number of bytes written to buf
  *    EOF if the buffer is too small
  */
-int dbg_enc_bin(char *buf, size_t buf_len, const char *data, size_t data_len)
+int dbg_enc_hex(char *buf, size_t buf_len, const char *data, size_t data_len)
+{
+	size_t pos;
+
+	if (buf_len < data_len*2) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	for (pos = 0; pos < data_len; pos++) {
+		*buf++ = dbg_get_digit((data[pos] >> 4) & 0xf);
+		*buf++ = dbg_get_digit((data[pos]     ) & 0xf);
+	}
+
+	return data_len*2;
+}
+
+/*
+ * Decode data from its hex-value representation to a buffer.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the buffer is too small
+ */
+int dbg_dec_hex(const char *buf, size_t buf_len, char *data, size_t data_len)
+{
+	size_t pos;
+	int tmp;
+
+	if (buf_len != data_len*2) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	for (pos = 0; pos < data_len; pos++) {
+		/* Decode high nibble */
+		tmp = dbg_get_val(*buf++, 16);
+		if (tmp == EOF) {
+			/* Buffer contained junk. */
+			ASSERT(0);
+			return EOF;
+		}
+
+		data[pos] = tmp << 4;
+
+		/* Decode low nibble */
+		tmp = dbg_get_val(*buf++, 16);
+		if (tmp == EOF) {
+			/* Buffer contained junk. */
+			ASSERT(0);
+			return EOF;
+		}
+		data[pos] |= tmp;
+	}
+
+	return 0;
+}
+
+/*
+ * Encode data to its binary representation in a buffer.
+ *
+ * Returns:
+ *    0+  number of bytes written to buf
+ *    EOF if the buffer is too small
+ */
+int dbg_enc_bin(char *buf, size_t buf_len, const char *data, size_t data_len)
+{
+	size_t buf_pos, data_pos;
+
+	for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
+		if (data[data_pos] == '$' ||
+			data[data_pos] == '#' ||
+			data[data_pos] == '}' ||
+			data[data_pos] == '*') {
+			if (buf_pos+1 >= buf_len) {
+				ASSERT(0);
+				return EOF;
+			}
+			buf[buf_pos++] = '}';
+			buf[buf_pos++] = data[data_pos] ^ 0x20;
+		} else {
+			if (buf_pos >= buf_len) {
+				ASSERT(0);
+				return EOF;
+			}
+			buf[buf_pos++] = data[data_pos];
+		}
+	}
+
+	return buf_pos;
+}
+
+/*
+ * Decode data from its bin-value representation to a buffer.
+ *
+ * Returns:
+ *    0+  if successful, number of bytes decoded
+ *    EOF if the buffer is too small
+ */
+int dbg_dec_bin(const char *buf, size_t buf_len, char *data, size_t data_len)
+{
+	size_t buf_pos, data_pos;
+
+	for (buf_pos = 0, data_pos = 0; buf_pos < buf_len; buf_pos++) {
+		if (data_pos >= data_len) {
+			/* Output buffer overflow */
+			ASSERT(0);
+			return EOF;
+		}
+		if (buf[buf_pos] == '}') {
+			/* The next byte is escaped! */
+			if (buf_pos+1 >= buf_len) {
+				/* There's an escape character, but no escaped character
+				 * following the escape character. */
+				ASSERT(0);
+				return EOF;
+			}
+			buf_pos += 1;
+			data[data_pos++] = buf[buf_pos] ^ 0x20;
+		} else {
+			data[data_pos++] = buf[buf_pos];
+		}
+	}
+
+	return data_pos;
+}
+
+/*
+ * Decode exactly data_len bytes from the start of a hex representation,
+ * leaving the rest of buf for later calls.
+ *
+ * Returns:
+ *    0+  number of characters of buf consumed
+ *    EOF if buf is too short or contains junk
+ */
+int dbg_dec_hex_part(const char *buf, size_t buf_len, char *data, size_t data_len)
+{
+	size_t pos;
+	int hi, lo;
+
+	if (buf_len < data_len*2) {
+		return EOF;
+	}
+	for (pos = 0; pos < data_len; pos++) {
+		hi = dbg_get_val(buf[2*pos], 16);
+		lo = dbg_get_val(buf[2*pos+1], 16);
+		if (hi == EOF || lo == EOF) {
+			return EOF;
+		}
+		data[pos] = (hi << 4) | lo;
+	}
+
+	return data_len*2;
+}
+
+/*
+ * Decode exactly data_len bytes from the start of a binary representation,
+ * leaving the rest of buf for later calls.
+ *
+ * Returns:
+ *    0+  number of characters of buf consumed
+ *    EOF if buf is too short
+ */
+int dbg_dec_bin_part(const char *buf, size_t buf_len, char *data, size_t data_len)
+{
+	size_t buf_pos, data_pos;
+
+	for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
+		if (buf_pos >= buf_len) {
+			return EOF;
+		}
+		if (buf[buf_pos] == '}') {
+			/* The next byte is escaped */
+			if (buf_pos+1 >= buf_len) {
+				return EOF;
+			}
+			data[data_pos] = buf[buf_pos+1] ^ 0x20;
+			buf_pos += 2;
+		} else {
+			data[data_pos] = buf[buf_pos++];
+		}
+	}
+
+	return buf_pos;
+}
+
+/*****************************************************************************
+ * CRC-32
+ ****************************************************************************/
+
+/*
+ * gdb's CRC-32 for qCRC: polynomial 0x04c11db7, most significant bit first,
+ * no reflection and no final inversion.  Computed slice-by-8, with
+ * dbg_crc_table[0] the usual byte-wise table and dbg_crc_table[k] advancing
+ * a byte by k further bytes of zeros.
+ */
+static uint32_t dbg_crc_table[8][256];
+
+static void dbg_crc_init(void)
+{
+	for (uint32_t i=0; i<256; i++) {
+		uint32_t crc = i << 24;
+		for (int bit=0; bit<8; bit++) {
+			crc = (crc & 0x80000000) ? (crc << 1) ^ 0x04c11db7 : (crc << 1);
+		}
+		dbg_crc_table[0][i] = crc;
+	}
+	for (uint32_t i=0; i<256; i++) {
+		for (int k=1; k<8; k++) {
+			uint32_t prev = dbg_crc_table[k-1][i];
+			dbg_crc_table[k][i] = (prev << 8) ^ dbg_crc_table[0][prev >> 24];
+		}
+	}
+}
+
+/*
+ * Continue a CRC over len more bytes.
+ */
+uint32_t dbg_crc32(uint32_t crc, const uint8_t *buf, size_t len)
+{
+	const uint32_t (*t)[256] = dbg_crc_table;
+
+	if (!t[0][1]) {
+		dbg_crc_init();
+	}
+
+	for (; len >= 8; len -= 8, buf += 8) {
+		crc ^= ((uint32_t)buf[0] << 24) | (buf[1] << 16) | (buf[2] << 8) | buf[3];
+		crc = t[7][crc >> 24] ^ t[6][(crc >> 16) & 0xff] ^
+		      t[5][(crc >> 8) & 0xff] ^ t[4][crc & 0xff] ^
+		      t[3][buf[4]] ^ t[2][buf[5]] ^ t[1][buf[6]] ^ t[0][buf[7]];
+	}
+	while (len--) {
+		crc = (crc << 8) ^ t[0][(crc >> 24) ^ *buf++];
+	}
+
+	return crc;
+}
+
+/*****************************************************************************
+ * Memory Search
+ ****************************************************************************/
+
+/*
+ * Find the first occurrence of pat in hay.  With SSE2, 16 candidate
+ * positions at a time are screened by comparing against broadcasts of the
+ * pattern's first and last bytes, and only survivors are verified.
+ *
+ * Returns a pointer to the match, or NULL if there is none.
+ */
+const char *dbg_memmem(const char *hay, size_t hay_len, const char *pat, size_t pat_len)
+{
+	size_t pos, last;
+
+	if (pat_len == 0) {
+		return hay;
+	}
+	if (pat_len > hay_len) {
+		return NULL;
+	}
+
+	/* Last position a match can start at */
+	last = hay_len - pat_len;
+	pos = 0;
+
+#ifdef __SSE2__
+	{
+		__m128i first = _mm_set1_epi8(pat[0]);
+		__m128i final = _mm_set1_epi8(pat[pat_len-1]);
+		for (; pos + 15 <= last; pos += 16) {
+			__m128i a = _mm_loadu_si128((const __m128i *)&hay[pos]);
+			__m128i b = _mm_loadu_si128((const __m128i *)&hay[pos+pat_len-1]);
+			unsigned mask = _mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(a, first),
+			                                                _mm_cmpeq_epi8(b, final)));
+			while (mask) {
+				size_t cand = pos + __builtin_ctz(mask);
+				if (!memcmp(&hay[cand+1], &pat[1], pat_len-1)) {
+					return &hay[cand];
+				}
+				mask &= mask - 1;
+			}
+		}
+	}
+#endif
+
+	for (; pos <= last; pos++) {
+		if (hay[pos] == pat[0] && !memcmp(&hay[pos+1], &pat[1], pat_len-1)) {
+			return &hay[pos];
+		}
+	}
+
+	return NULL;
+}
+
+/*****************************************************************************
+ * Command Functions
+ ****************************************************************************/
+
+/*
+ * Read from memory and add it to a packet in hex.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the memory can't be read or the packet is full
+ */
+int dbg_mem_read(dbg_tx *tx, address addr, size_t len)
+{
+	char data[DBG_PKT_SIZE];
+	size_t pos;
+
+	if (len > sizeof(data)) {
+		return EOF;
+	}
+
+	/* Read from system memory */
+	for (pos = 0; pos < len; pos++) {
+		if (dbg_sys_mem_readb(addr+pos, &data[pos])) {
+			/* Failed to read */
+			return EOF;
+		}
+	}
+
+	/* Encode data */
+	return dbg_tx_hex(tx, data, len);
+}
+
+/*
+ * Read from memory and add it to a packet in binary form.  Stops early at
+ * the first byte that won't fit, or that can't be read once at least one
+ * byte has been, as gdb asks again for the rest.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if nothing could be read
+ */
+int dbg_mem_read_bin(dbg_tx *tx, address addr, size_t len)
+{
+	char data[DBG_PKT_SIZE];
+	size_t pos;
+
+	if (len > sizeof(data)) {
+		len = sizeof(data);
+	}
+
+	/* Read from system memory */
+	for (pos = 0; pos < len; pos++) {
+		if (dbg_sys_mem_readb(addr+pos, &data[pos])) {
+			break;
+		}
+	}
+	if (len && !pos) {
+		return EOF;
+	}
+
+	/* Encode data */
+	dbg_tx_bin(tx, data, pos);
+	return 0;
+}
+
+/*
+ * Compute gdb's CRC-32 over memory, a page at a time where whole pages
+ * can be had directly.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if part of the memory can't be read
+ */
+int dbg_mem_crc(address addr, size_t len, uint32_t *crc)
+{
+	*crc = 0xffffffff;
+
+	while (len) {
+		size_t chunk = DBG_PAGE_SIZE - (addr & DBG_PAGE_MASK);
+		const uint8_t *page;
+
+		if (chunk > len) {
+			chunk = len;
+		}
+		page = dbg_sys_mem_page(addr, 0);
+		if (page) {
+			*crc = dbg_crc32(*crc, page + (addr & DBG_PAGE_MASK), chunk);
+		} else {
+			/* Page straddles regions or a gap, go byte by byte */
+			for (size_t pos = 0; pos < chunk; pos++) {
+				char ch;
+				if (dbg_sys_mem_readb(addr+pos, &ch)) {
+					return EOF;
+				}
+				*crc = dbg_crc32(*crc, (const uint8_t *)&ch, 1);
+			}
+		}
+		addr += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+/*
+ * Copy memory into buf, a page at a time where whole pages can be had
+ * directly.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if part of the memory can't be read
+ */
+int dbg_mem_copy(char *buf, address addr, size_t len)
+{
+	while (len) {
+		size_t chunk = DBG_PAGE_SIZE - (addr & DBG_PAGE_MASK);
+		const uint8_t *page;
+
+		if (chunk > len) {
+			chunk = len;
+		}
+		page = dbg_sys_mem_page(addr, 0);
+		if (page) {
+			memcpy(buf, page + (addr & DBG_PAGE_MASK), chunk);
+		} else {
+			for (size_t pos = 0; pos < chunk; pos++) {
+				if (dbg_sys_mem_readb(addr+pos, &buf[pos])) {
+					return EOF;
+				}
+			}
+		}
+		buf += chunk;
+		addr += chunk;
+		len -= chunk;
+	}
+
+	return 0;
+}
+
+#define DBG_SEARCH_CHUNK 0x4000
+
+/*
+ * Search len bytes of memory from addr for pat.  Memory is scanned in
+ * chunks, each prefixed with the tail of the one before so that matches
+ * straddling chunks, pages or adjacent regions are still found.
+ *
+ * Returns:
+ *    1   if found, with the address in found
+ *    0   if not found
+ *    EOF if part of the memory can't be read
+ */
+int dbg_mem_search(address addr, size_t len, const char *pat, size_t pat_len, address *found)
+{
+	static char buf[DBG_PKT_SIZE + DBG_SEARCH_CHUNK];
+	address base = addr;  /* Address of buf[0] */
+	size_t keep = 0;      /* Bytes carried over from the last chunk */
+
+	if (pat_len > DBG_PKT_SIZE) {
+		return EOF;
+	}
+
+	while (len >= pat_len - keep && len) {
+		size_t chunk = (len < DBG_SEARCH_CHUNK) ? len : DBG_SEARCH_CHUNK;
+		const char *hit;
+
+		if (dbg_mem_copy(&buf[keep], addr, chunk) == EOF) {
+			return EOF;
+		}
+		hit = dbg_memmem(buf, keep + chunk, pat, pat_len);
+		if (hit) {
+			*found = base + (hit - buf);
+			return 1;
+		}
+
+		/* Carry over what could still start a match */
+		addr += chunk;
+		len -= chunk;
+		keep += chunk;
+		if (keep > pat_len - 1) {
+			memmove(buf, &buf[keep - (pat_len - 1)], pat_len - 1);
+			base += keep - (pat_len - 1);
+			keep = pat_len - 1;
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * Write len bytes to memory from their representation in buf, which must
+ * hold exactly that many.  Each page that can be had directly is decoded
+ * into in place, its private copy made first if it was shared; the rest
+ * go through dbg_sys_mem_writeb.  Pages before a malformed part of buf are
+ * left written.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if buf is malformed or the memory can't be written
+ */
+int dbg_mem_write(const char *buf, size_t buf_len, address addr, size_t len, dbg_dec_part_func dec)
+{
+	char data[DBG_PAGE_SIZE];
+	size_t chunk, pos;
+	uint8_t *page;
+	int used;
+
+	while (len) {
+		chunk = DBG_PAGE_SIZE - (addr & DBG_PAGE_MASK);
+		if (chunk > len) {
+			chunk = len;
+		}
+
+		page = dbg_sys_mem_page(addr, 1);
+		if (page) {
+			used = dec(buf, buf_len, (char *)&page[addr & DBG_PAGE_MASK], chunk);
+			dbg_sys_mem_dirty(addr, chunk);
+		} else {
+			used = dec(buf, buf_len, data, chunk);
+			for (pos = 0; used != EOF && pos < chunk; pos++) {
+				if (dbg_sys_mem_writeb(addr+pos, data[pos])) {
+					/* Failed to write */
+					return EOF;
+				}
+			}
+		}
+		if (used == EOF) {
+			return EOF;
+		}
+
+		buf += used;
+		buf_len -= used;
+		addr += chunk;
+		len -= chunk;
+	}
+
+	return buf_len ? EOF : 0;
+}
+
+/*
+ * Continue program execution at PC.
+ *
+ * Returns the signal the target stopped with.
+ */
+int dbg_continue(void)
+{
+	return dbg_sys_continue();
+}
+
+/*
+ * Step one instruction.
+ *
+ * Returns the signal the target stopped with.
+ */
+int dbg_step(void)
+{
+	return dbg_sys_step();
+}
+
+/*
+ * Run a monitor command, sending its output to the debugger's console.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the command is unknown or its output couldn't be sent
+ */
+int dbg_monitor(const char *cmd)
+{
+	char *out;
+	size_t len;
+	FILE *fp;
+	int status;
+
+	if (strcmp(cmd, "stats")) {
+		return EOF;
+	}
+	fp = open_memstream(&out, &len);
+	if (!fp) {
+		return EOF;
+	}
+	dbg_stats_write(fp);
+	fclose(fp);
+	status = dbg_send_console(out, len);
+	free(out);
+	return status;
+}
+
+/*****************************************************************************
+ * Packet Creation Helpers
+ ****************************************************************************/
+
+/*
+ * Send OK packet
+ */
+int dbg_send_ok_packet(char *buf, size_t buf_len)
+{
+	return dbg_send_packet("OK", 2);
+}
+
+/*
+ * Send a message to the debugging console (via O XX... packet)
+ */
+int dbg_send_conmsg_packet(char *buf, size_t buf_len, const char *msg)
 {
-	size_t buf_pos, data_pos;
+	size_t size;
+	int status;
 
-	for (buf_pos = 0, data_pos = 0; data_pos < data_len; data_pos++) {
-		if (data[data_pos] == '$' ||
-			data[data_pos] == '#' ||
-			data[data_pos] == '}' ||
-			data[data_pos] == '*') {
-			if (buf_pos+1 >= buf_len) {
-				ASSERT(0);
+	if (buf_len < 2) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	buf[0] = 'O';
+	status = dbg_enc_hex(&buf[1], buf_len-1, msg, dbg_strlen(msg));
+	if (status == EOF) {
+		return EOF;
+	}
+	size = 1 + status;
+	return dbg_send_packet(buf, size);
+}
+
+/*
+ * Send a signal packet (S AA).
+ */
+int dbg_send_signal_packet(char *buf, size_t buf_len, char signal)
+{
+	size_t size;
+	int status;
+
+	if (buf_len < 4) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	buf[0] = 'S';
+	status = dbg_enc_hex(&buf[1], buf_len-1, &signal, 1);
+	if (status == EOF) {
+		return EOF;
+	}
+	size = 1 + status;
+	return dbg_send_packet(buf, size);
+}
+
+/*
+ * Send a stop reply for a resumed target.  Breakpoint and watchpoint hits
+ * are reported with a T AA packet carrying the stop reason, anything else
+ * as S AA.
+ */
+int dbg_send_stop_packet(char *buf, size_t buf_len, struct dbg_state *state, char signal)
+{
+	const char *reason;
+	size_t size;
+	int status;
+	int watch = 0;
+
+	switch (state->stop_reason) {
+	case DBG_STOP_SWBREAK: reason = "swbreak:"; break;
+	case DBG_STOP_HWBREAK: reason = "hwbreak:"; break;
+	case DBG_STOP_WATCH:   reason = "watch:"; watch = 1; break;
+	case DBG_STOP_RWATCH:  reason = "rwatch:"; watch = 1; break;
+	case DBG_STOP_AWATCH:  reason = "awatch:"; watch = 1; break;
+	default:
+		return dbg_send_signal_packet(buf, buf_len, signal);
+	}
+
+	if (buf_len < 4 + strlen(reason) + 8) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	buf[0] = 'T';
+	status = dbg_enc_hex(&buf[1], buf_len-1, &signal, 1);
+	if (status == EOF) {
+		return EOF;
+	}
+	size = 1 + status;
+	memcpy(&buf[size], reason, strlen(reason));
+	size += strlen(reason);
+	if (watch) {
+		/* Data address, most significant digit first */
+		for (int shift = 28; shift >= 0; shift -= 4) {
+			buf[size++] = dbg_get_digit((state->stop_addr >> shift) & 0xf);
+		}
+	}
+	buf[size++] = ';';
+	return dbg_send_packet(buf, size);
+}
+
+/*
+ * Send a error packet (E AA).
+ */
+int dbg_send_error_packet(char *buf, size_t buf_len, char error)
+{
+	size_t size;
+	int status;
+
+	if (buf_len < 4) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	buf[0] = 'E';
+	status = dbg_enc_hex(&buf[1], buf_len-1, &error, 1);
+	if (status == EOF) {
+		return EOF;
+	}
+	size = 1 + status;
+	return dbg_send_packet(buf, size);
+}
+
+/*
+ * Send part of an object read with qXfer: m followed by the data if more
+ * remains after it, l if this is the end of the object.
+ */
+int dbg_send_xfer_packet(char *buf, size_t buf_len, const char *obj, size_t obj_len, size_t offset, size_t len)
+{
+	int status;
+
+	if (offset > obj_len) {
+		offset = obj_len;
+	}
+	if (len > obj_len - offset) {
+		len = obj_len - offset;
+	}
+	if (len > (buf_len - 1) / 2) {
+		/* Leave room for every byte to be escaped */
+		len = (buf_len - 1) / 2;
+	}
+
+	buf[0] = (offset + len < obj_len) ? 'm' : 'l';
+	status = dbg_enc_bin(&buf[1], buf_len-1, &obj[offset], len);
+	if (status == EOF) {
+		return EOF;
+	}
+	return dbg_send_packet(buf, 1 + status);
+}
+
+/*
+ * Send text to the debugger's console, in as many O packets as it takes.
+ */
+int dbg_send_console(const char *msg, size_t len)
+{
+	dbg_tx tx;
+	size_t n;
+
+	for (; len; msg += n, len -= n) {
+		n = (len < DBG_PKT_SIZE / 2 - 8) ? len : DBG_PKT_SIZE / 2 - 8;
+		dbg_tx_begin(&tx);
+		dbg_tx_data(&tx, "O", 1);
+		dbg_tx_hex(&tx, msg, n);
+		if (dbg_tx_end(&tx) == EOF) {
+			return EOF;
+		}
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Communication Functions
+ ****************************************************************************/
+
+/*
+ * Write a sequence of bytes.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if failed to write all bytes
+ */
+int dbg_write(const char *buf, size_t len)
+{
+	return dbg_sys_write(buf, len);
+}
+
+/*
+ * Read a sequence of bytes.
+ *
+ * Returns:
+ *    0   if successfully read len bytes
+ *    EOF if failed to read all bytes
+ */
+int dbg_read(char *buf, size_t buf_len, size_t len)
+{
+	char c;
+
+	if (buf_len < len) {
+		/* Buffer too small */
+		return EOF;
+	}
+
+	while (len--) {
+		if ((c = dbg_sys_getc()) == EOF) {
+			return EOF;
+		}
+		*buf++ = c;
+	}
+
+	return 0;
+}
+
+
+/*****************************************************************************
+ * Registers
+ ****************************************************************************/
+
+/*
+ * The registers a dump has.  By default g/G/p/P use gdb's built-in lx106
+ * numbers, 113 registers with the ones a dump lacks sent as xxxxxxxx.
+ * With --tdesc they use this table's order instead, which target.xml
+ * describes; that is only for a gdb which applies the description, as a
+ * stock xtensa gdb keeps its built-in layout.  The two are never mixed.
+ */
+static const struct dbg_reg {
+	const char *name;
+	const char *type;
+	size_t      offset;  /* of the uint32_t in registers */
+	unsigned    lx106;   /* number in gdb's built-in lx106 layout */
+} dbg_regs[] = {
+	{ "pc",      "code_ptr", offsetof(registers, pc),         0 },
+	{ "ps",      "uint32",   offsetof(registers, ps),        42 },
+	{ "sar",     "uint32",   offsetof(registers, sar),       36 },
+	{ "litbase", "uint32",   offsetof(registers, litbase),   37 },
+	{ "sr176",   "uint32",   offsetof(registers, sr176),     40 },
+	{ "a0",      "code_ptr", offsetof(registers, a[0]),      97 },
+	{ "a1",      "data_ptr", offsetof(registers, a[1]),      98 },
+	{ "a2",      "uint32",   offsetof(registers, a[2]),      99 },
+	{ "a3",      "uint32",   offsetof(registers, a[3]),     100 },
+	{ "a4",      "uint32",   offsetof(registers, a[4]),     101 },
+	{ "a5",      "uint32",   offsetof(registers, a[5]),     102 },
+	{ "a6",      "uint32",   offsetof(registers, a[6]),     103 },
+	{ "a7",      "uint32",   offsetof(registers, a[7]),     104 },
+	{ "a8",      "uint32",   offsetof(registers, a[8]),     105 },
+	{ "a9",      "uint32",   offsetof(registers, a[9]),     106 },
+	{ "a10",     "uint32",   offsetof(registers, a[10]),    107 },
+	{ "a11",     "uint32",   offsetof(registers, a[11]),    108 },
+	{ "a12",     "uint32",   offsetof(registers, a[12]),    109 },
+	{ "a13",     "uint32",   offsetof(registers, a[13]),    110 },
+	{ "a14",     "uint32",   offsetof(registers, a[14]),    111 },
+	{ "a15",     "uint32",   offsetof(registers, a[15]),    112 },
+};
+
+#define DBG_NUM_REGISTERS   (sizeof(dbg_regs) / sizeof(dbg_regs[0]))
+#define DBG_LX106_REGISTERS 113
+#define DBG_REG(state, n) ((char *)&(state)->regs + dbg_regs[n].offset)
+
+/*
+ * Get the number of registers in a g packet.
+ */
+static size_t dbg_num_regs(void)
+{
+	return dbg_use_tdesc ? DBG_NUM_REGISTERS : DBG_LX106_REGISTERS;
+}
+
+/*
+ * Find a register by its number in the layout in use.
+ *
+ * Returns:
+ *    0+  index in dbg_regs
+ *    EOF if the dump has no such register
+ */
+static int dbg_reg_index(address n)
+{
+	if (dbg_use_tdesc) {
+		return (n < DBG_NUM_REGISTERS) ? (int)n : EOF;
+	}
+	for (size_t i=0; i<DBG_NUM_REGISTERS; i++) {
+		if (dbg_regs[i].lx106 == n) {
+			return i;
+		}
+	}
+	return EOF;
+}
+
+/*
+ * Get the target description, built from dbg_regs on first use.  gdb
+ * defines no standard xtensa feature, so the feature name is the stub's.
+ */
+static const char *dbg_target_xml(void)
+{
+	static char xml[4096];
+	size_t pos;
+
+	if (xml[0]) {
+		return xml;
+	}
+	pos = snprintf(xml, sizeof(xml),
+	               "<?xml version=\"1.0\"?>\n"
+	               "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+	               "<target version=\"1.0\">\n"
+	               "  <architecture>xtensa</architecture>\n"
+	               "  <feature name=\"esp8266.lx106.core\">\n");
+	for (size_t n=0; n<DBG_NUM_REGISTERS; n++) {
+		pos += snprintf(&xml[pos], sizeof(xml) - pos,
+		                "    <reg name=\"%s\" bitsize=\"32\" type=\"%s\" regnum=\"%zu\"/>\n",
+		                dbg_regs[n].name, dbg_regs[n].type, n);
+	}
+	pos += snprintf(&xml[pos], sizeof(xml) - pos, "  </feature>\n</target>\n");
+	return xml;
+}
+
+/*****************************************************************************
+ * Command Handlers
+ ****************************************************************************/
+
+/*
+ * A packet being handled.  Integer arguments are parsed from the command's
+ * argument format before its handler runs; whatever follows them, such as
+ * the data of a write, starts at next.  The packet buffer is free for
+ * building the reply once the handler is done reading from it.
+ */
+typedef struct dbg_args {
+	struct dbg_state *state;
+	char       *buf;       /* Packet data, reused for the reply */
+	size_t      buf_size;
+	const char *next;      /* First character not yet parsed */
+	const char *end;
+	size_t      num;       /* Number of integer arguments in val */
+	address     val[4];
+} dbg_args;
+
+/* Handlers return 0 once they have replied, EOF for an error reply */
+typedef int (*dbg_handler)(dbg_args *args);
+
+#define dbg_args_remaining(args) ((size_t)((args)->end - (args)->next))
+
+/* Set by D, ending dbg_main */
+static int dbg_detached;
+
+/*
+ * Parse arguments as described by fmt, in which '%' stands for a hex
+ * integer and any other character must appear as it is.  On failure
+ * nothing is consumed.
+ *
+ * Returns:
+ *    0   if successful
+ *    EOF if the arguments don't match fmt
+ */
+static int dbg_args_parse(dbg_args *args, const char *fmt)
+{
+	const char *next = args->next;
+	size_t num = args->num;
+
+	for (; *fmt; fmt++) {
+		if (*fmt == '%') {
+			if (num == sizeof(args->val)/sizeof(args->val[0]) ||
+			    !(next = dbg_parse_hex(next, args->end, &args->val[num]))) {
 				return EOF;
 			}
-			buf[buf_pos++] = '}';
-			buf[buf_pos++] = data[data_pos] ^ 0x20;
+			num++;
+		} else if (next == args->end || *next++ != *fmt) {
+			return EOF;
+		}
+	}
+	args->next = next;
+	args->num = num;
+	return 0;
+}
+
+/*
+ * Read Registers
+ * Command Format: g
+ */
+static int dbg_cmd_read_regs(dbg_args *args)
+{
+	dbg_tx tx;
+	int status;
+
+	dbg_tx_begin(&tx);
+	for (size_t n=0; n<dbg_num_regs(); n++) {
+		int idx = dbg_reg_index(n);
+		if (idx == EOF) {
+			status = dbg_tx_data(&tx, "xxxxxxxx", 2 * sizeof(uint32_t));
 		} else {
-			if (buf_pos >= buf_len) {
-				ASSERT(0);
-				return EOF;
-			}
-			buf[buf_pos++] = data[data_pos];
+			status = dbg_tx_hex(&tx, DBG_REG(args->state, idx), sizeof(uint32_t));
+		}
+		if (status == EOF) {
+			return EOF;
+		}
+	}
+	dbg_tx_end(&tx);
+	return 0;
+}
+
+/*
+ * Write Registers
+ * Command Format: G XX...
+ */
+static int dbg_cmd_write_regs(dbg_args *args)
+{
+	uint32_t vals[DBG_NUM_REGISTERS];
+
+	if (dbg_args_remaining(args) != dbg_num_regs() * sizeof(uint32_t) * 2) {
+		return EOF;
+	}
+	/* Decode them all first, so junk leaves the registers untouched.  Every
+	 * register in dbg_regs has a slot in either layout; the rest are
+	 * ignored. */
+	for (size_t n=0; n<dbg_num_regs(); n++) {
+		int idx = dbg_reg_index(n);
+		if ((idx != EOF) &&
+		    (dbg_dec_hex_part(args->next, dbg_args_remaining(args),
+		                      (char *)&vals[idx], sizeof(uint32_t)) == EOF)) {
+			return EOF;
+		}
+		args->next += 2 * sizeof(uint32_t);
+	}
+	for (size_t n=0; n<DBG_NUM_REGISTERS; n++) {
+		memcpy(DBG_REG(args->state, n), &vals[n], sizeof(uint32_t));
+	}
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
+}
+
+/*
+ * Read a Register
+ * Command Format: p n
+ */
+static int dbg_cmd_read_reg(dbg_args *args)
+{
+	int n = dbg_reg_index(args->val[0]);
+	int status;
+
+	if (n == EOF) {
+		if (args->val[0] >= dbg_num_regs()) {
+			return EOF;
 		}
+		/* In the layout, but not in a dump */
+		dbg_send_packet_string("xxxxxxxx");
+		return 0;
+	}
+	status = dbg_enc_hex(args->buf, args->buf_size,
+	                     DBG_REG(args->state, n), sizeof(uint32_t));
+	if (status == EOF) {
+		return EOF;
 	}
-
-	return buf_pos;
+	dbg_send_packet(args->buf, status);
+	return 0;
 }
 
 /*
- * Decode data from its bin-value representation to a buffer.
- *
- * Returns:
- *    0+  if successful, number of bytes decoded
- *    EOF if the buffer is too small
+ * Write a Register
+ * Command Format: P n...=r...
  */
-int dbg_dec_bin(const char *buf, size_t buf_len, char *data, size_t data_len)
+static int dbg_cmd_write_reg(dbg_args *args)
 {
-	size_t buf_pos, data_pos;
+	int n = dbg_reg_index(args->val[0]);
+	uint32_t val;
 
-	for (buf_pos = 0, data_pos = 0; buf_pos < buf_len; buf_pos++) {
-		if (data_pos >= data_len) {
-			/* Output buffer overflow */
-			ASSERT(0);
-			return EOF;
-		}
-		if (buf[buf_pos] == '}') {
-			/* The next byte is escaped! */
-			if (buf_pos+1 >= buf_len) {
-				/* There's an escape character, but no escaped character
-				 * following the escape character. */
-				ASSERT(0);
-				return EOF;
-			}
-			buf_pos += 1;
-			data[data_pos++] = buf[buf_pos] ^ 0x20;
-		} else {
-			data[data_pos++] = buf[buf_pos];
-		}
+	if (n == EOF || dbg_args_remaining(args) != 2 * sizeof(val) ||
+	    dbg_dec_hex_part(args->next, dbg_args_remaining(args),
+	                     (char *)&val, sizeof(val)) == EOF) {
+		return EOF;
 	}
-
-	return data_pos;
+	memcpy(DBG_REG(args->state, n), &val, sizeof(val));
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
 }
 
-/*****************************************************************************
- * Command Functions
- ****************************************************************************/
-
 /*
- * Read from memory and encode into buf.
- *
- * Returns:
- *    0+  number of bytes written to buf
- *    EOF if the buffer is too small
+ * Read Memory
+ * Command Format: m addr,length
  */
-int dbg_mem_read(char *buf, size_t buf_len, address addr, size_t len, dbg_enc_func enc)
+static int dbg_cmd_read_mem(dbg_args *args)
 {
-	char data[64];
-	size_t pos;
+	dbg_tx tx;
 
-	if (len > sizeof(data)) {
+	dbg_tx_begin(&tx);
+	if (dbg_mem_read(&tx, args->val[0], args->val[1]) == EOF) {
 		return EOF;
 	}
+	dbg_tx_end(&tx);
+	return 0;
+}
 
-	/* Read from system memory */
-	for (pos = 0; pos < len; pos++) {
-		if (dbg_sys_mem_readb(addr+pos, &data[pos])) {
-			/* Failed to read */
-			return EOF;
-		}
-	}
+/*
+ * Read Memory (Binary)
+ * Command Format: x addr,length
+ */
+static int dbg_cmd_read_mem_bin(dbg_args *args)
+{
+	dbg_tx tx;
 
-	/* Encode data */
-	return enc(buf, buf_len, data, len);
+	dbg_tx_begin(&tx);
+	dbg_tx_data(&tx, "b", 1);
+	if (dbg_mem_read_bin(&tx, args->val[0], args->val[1]) == EOF) {
+		return EOF;
+	}
+	dbg_tx_end(&tx);
+	return 0;
 }
 
 /*
- * Write to memory from encoded buf.
+ * Write Memory
+ * Command Format: M addr,length:XX..
  */
-int dbg_mem_write(const char *buf, size_t buf_len, address addr, size_t len, dbg_dec_func dec)
+static int dbg_cmd_write_mem(dbg_args *args)
 {
-	char data[64];
-	size_t pos;
+	if (dbg_mem_write(args->next, dbg_args_remaining(args),
+	                  args->val[0], args->val[1], dbg_dec_hex_part) == EOF) {
+		return EOF;
+	}
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
+}
 
-	if (len > sizeof(data)) {
+/*
+ * Write Memory (Binary)
+ * Command Format: X addr,length:XX..
+ */
+static int dbg_cmd_write_mem_bin(dbg_args *args)
+{
+	if (dbg_mem_write(args->next, dbg_args_remaining(args),
+	                  args->val[0], args->val[1], dbg_dec_bin_part) == EOF) {
 		return EOF;
 	}
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
+}
+
+/*
+ * Insert/Remove Breakpoint or Watchpoint
+ * Command Format: Z type,addr,kind / z type,addr,kind
+ */
+static int dbg_cmd_point(dbg_args *args)
+{
+	int insert = (args->buf[0] == 'Z');
+	address addr = args->val[1];
+	size_t length = args->val[2];
+	int status;
 
-	/* Decode data */
-	if (dec(buf, buf_len, data, len) == EOF) {
+	switch (args->val[0]) {
+	case 0: status = dbg_sys_breakpoint(DBG_BP_SW, addr, insert); break;
+	case 1: status = dbg_sys_breakpoint(DBG_BP_HW, addr, insert); break;
+	case 2: status = dbg_sys_watchpoint(DBG_WP_WRITE, addr, length, insert); break;
+	case 3: status = dbg_sys_watchpoint(DBG_WP_READ, addr, length, insert); break;
+	case 4: status = dbg_sys_watchpoint(DBG_WP_ACCESS, addr, length, insert); break;
+	default:
+		/* Unsupported type */
+		dbg_send_packet(NULL, 0);
+		return 0;
+	}
+	if (status) {
 		return EOF;
 	}
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
+}
 
-	/* Write to system memory */
-	for (pos = 0; pos < len; pos++) {
-		if (dbg_sys_mem_writeb(addr+pos, data[pos])) {
-			/* Failed to write */
+/*
+ * Detach
+ * Command Format: D
+ *
+ * Ends dbg_main once the reply is out, leaving teardown to its caller.
+ */
+static int dbg_cmd_detach(dbg_args *args)
+{
+	dbg_send_ok_packet(NULL, 0);
+	dbg_detached = 1;
+	return 0;
+}
+
+/*
+ * Continue
+ * Command Format: c [addr]
+ */
+static int dbg_cmd_continue(dbg_args *args)
+{
+	if (dbg_args_remaining(args)) {
+		if (dbg_args_parse(args, "%") == EOF) {
 			return EOF;
 		}
+		args->state->regs.pc = args->val[0];
 	}
-
+	dbg_send_stop_packet(args->buf, args->buf_size, args->state,
+	                     dbg_continue());
 	return 0;
 }
 
 /*
- * Continue program execution at PC.
+ * Single-step
+ * Command Format: s [addr]
  */
-int dbg_continue(void)
+static int dbg_cmd_step(dbg_args *args)
+{
+	if (dbg_args_remaining(args)) {
+		if (dbg_args_parse(args, "%") == EOF) {
+			return EOF;
+		}
+		args->state->regs.pc = args->val[0];
+	}
+	dbg_send_stop_packet(args->buf, args->buf_size, args->state,
+	                     dbg_step());
+	return 0;
+}
+
+static int dbg_cmd_halt_reason(dbg_args *args)
 {
-	dbg_sys_continue();
+	dbg_send_signal_packet(args->buf, args->buf_size, 0);
 	return 0;
 }
 
 /*
- * Step one instruction.
+ * Query supported
  */
-int dbg_step(void)
+static int dbg_query_supported(dbg_args *args)
 {
-	dbg_sys_step();
+	if (dbg_use_tdesc) {
+		dbg_send_packet_string("swbreak+;hwbreak+;PacketSize=1000;binary-upload+;"
+		                       "qXfer:memory-map:read+;qXfer:features:read+");
+	} else {
+		dbg_send_packet_string("swbreak+;hwbreak+;PacketSize=1000;binary-upload+;"
+		                       "qXfer:memory-map:read+");
+	}
 	return 0;
 }
 
-/*****************************************************************************
- * Packet Creation Helpers
- ****************************************************************************/
+static int dbg_query_attached(dbg_args *args)
+{
+	dbg_send_packet_string("1");
+	return 0;
+}
 
 /*
- * Send OK packet
+ * Command Format: qXfer:memory-map:read::offset,length
+ * Command Format: qXfer:features:read:target.xml:offset,length
  */
-int dbg_send_ok_packet(char *buf, size_t buf_len)
+static int dbg_query_xfer(dbg_args *args)
 {
-	return dbg_send_packet("OK", 2);
+	const char *obj;
+
+	if (!dbg_args_parse(args, ":memory-map:read::%,%")) {
+		obj = dbg_sys_memory_map();
+		if (!obj) {
+			return EOF;
+		}
+	} else if (dbg_use_tdesc &&
+	           !dbg_args_parse(args, ":features:read:target.xml:%,%")) {
+		obj = dbg_target_xml();
+	} else {
+		dbg_send_packet(NULL, 0);
+		return 0;
+	}
+	dbg_send_xfer_packet(args->buf, args->buf_size, obj, strlen(obj),
+	                     args->val[0], args->val[1]);
+	return 0;
 }
 
 /*
- * Send a message to the debugging console (via O XX... packet)
+ * Command Format: qSearch:memory:addr;length;pattern
  */
-int dbg_send_conmsg_packet(char *buf, size_t buf_len, const char *msg)
+static int dbg_query_search(dbg_args *args)
 {
-	size_t size;
+	static char pat[DBG_PKT_SIZE];
+	size_t pat_len;
+	address found;
+	dbg_tx tx;
 	int status;
 
-	if (buf_len < 2) {
-		/* Buffer too small */
+	/* A byte at a time, so an escape cut off at the end is an error */
+	for (pat_len = 0; args->next < args->end; pat_len++) {
+		if (pat_len == sizeof(pat)) {
+			return EOF;
+		}
+		status = dbg_dec_bin_part(args->next, dbg_args_remaining(args),
+		                          &pat[pat_len], 1);
+		if (status == EOF) {
+			return EOF;
+		}
+		args->next += status;
+	}
+	if (!pat_len) {
 		return EOF;
 	}
-
-	buf[0] = 'O';
-	status = dbg_enc_hex(&buf[1], buf_len-1, msg, dbg_strlen(msg));
+	status = dbg_mem_search(args->val[0], args->val[1], pat, pat_len, &found);
 	if (status == EOF) {
 		return EOF;
+	} else if (!status) {
+		dbg_send_packet_string("0");
+		return 0;
 	}
-	size = 1 + status;
-	return dbg_send_packet(buf, size);
+	dbg_tx_begin(&tx);
+	dbg_tx_data(&tx, "1,", 2);
+	for (int shift = 28; shift >= 0; shift -= 4) {
+		char ch = dbg_get_digit((found >> shift) & 0xf);
+		dbg_tx_data(&tx, &ch, 1);
+	}
+	dbg_tx_end(&tx);
+	return 0;
 }
 
 /*
- * Send a signal packet (S AA).
+ * Command Format: qCRC:addr,length
  */
-int dbg_send_signal_packet(char *buf, size_t buf_len, char signal)
+static int dbg_query_crc(dbg_args *args)
 {
-	size_t size;
-	int status;
+	uint32_t crc;
 
-	if (buf_len < 4) {
-		/* Buffer too small */
+	if (dbg_mem_crc(args->val[0], args->val[1], &crc) == EOF) {
 		return EOF;
 	}
-
-	buf[0] = 'S';
-	status = dbg_enc_hex(&buf[1], buf_len-1, &signal, 1);
-	if (status == EOF) {
-		return EOF;
+	args->buf[0] = 'C';
+	for (int i=0; i<8; i++) {
+		args->buf[1+i] = dbg_get_digit((crc >> (28 - 4*i)) & 0xf);
 	}
-	size = 1 + status;
-	return dbg_send_packet(buf, size);
+	dbg_send_packet(args->buf, 9);
+	return 0;
 }
 
 /*
- * Send a error packet (E AA).
+ * Command Format: qRcmd,command (hex)
  */
-int dbg_send_error_packet(char *buf, size_t buf_len, char error)
+static int dbg_query_rcmd(dbg_args *args)
 {
-	size_t size;
-	int status;
+	char cmd[64];
+	size_t length = dbg_args_remaining(args) / 2;
 
-	if (buf_len < 4) {
-		/* Buffer too small */
+	if (length >= sizeof(cmd) || dbg_args_remaining(args) != 2 * length ||
+	    dbg_dec_hex_part(args->next, dbg_args_remaining(args), cmd, length) == EOF) {
 		return EOF;
 	}
-
-	buf[0] = 'E';
-	status = dbg_enc_hex(&buf[1], buf_len-1, &error, 1);
-	if (status == EOF) {
-		return EOF;
+	cmd[length] = '\0';
+	if (dbg_monitor(cmd) == EOF) {
+		/* Unknown command */
+		dbg_send_packet(NULL, 0);
+		return 0;
 	}
-	size = 1 + status;
-	return dbg_send_packet(buf, size);
+	dbg_send_ok_packet(args->buf, args->buf_size);
+	return 0;
 }
 
 /*****************************************************************************
- * Communication Functions
+ * Command Dispatch
  ****************************************************************************/
 
+typedef struct dbg_cmd {
+	const char *fmt;  /* Arguments, for dbg_args_parse */
+	dbg_handler fn;
+} dbg_cmd;
+
+static int dbg_cmd_query(dbg_args *args);
+
+/* One letter commands, by letter */
+static const dbg_cmd dbg_cmds[128] = {
+	['q'] = { "",      dbg_cmd_query },
+	['Q'] = { "",      dbg_cmd_query },
+	['g'] = { "",      dbg_cmd_read_regs },
+	['G'] = { "",      dbg_cmd_write_regs },
+	['p'] = { "%",     dbg_cmd_read_reg },
+	['P'] = { "%=",    dbg_cmd_write_reg },
+	['m'] = { "%,%",   dbg_cmd_read_mem },
+	['x'] = { "%,%",   dbg_cmd_read_mem_bin },
+	['M'] = { "%,%:",  dbg_cmd_write_mem },
+	['X'] = { "%,%:",  dbg_cmd_write_mem_bin },
+	['Z'] = { "%,%,%", dbg_cmd_point },
+	['z'] = { "%,%,%", dbg_cmd_point },
+	['D'] = { "",      dbg_cmd_detach },
+	['c'] = { "",      dbg_cmd_continue },
+	['s'] = { "",      dbg_cmd_step },
+	['?'] = { "",      dbg_cmd_halt_reason },
+};
+
 /*
- * Write a sequence of bytes.
- *
- * Returns:
- *    0   if successful
- *    EOF if failed to write all bytes
+ * Queries, named up to their first ':', ',' or ';', with the second and
+ * last characters of the name and the arguments that follow it.  They are
+ * found by a hash of the name's length and those two characters.  The hash
+ * is checked to be perfect at compile time, as each query is a case label
+ * in dbg_query_find and a collision won't compile.  It is also collision
+ * free over the queries gdb sends that aren't supported yet.
  */
-int dbg_write(const char *buf, size_t len)
+#define DBG_QUERIES(X) \
+	X("qSupported", 'S', 'd', "",             dbg_query_supported) \
+	X("qAttached",  'A', 'd', "",             dbg_query_attached)  \
+	X("qXfer",      'X', 'r', "",             dbg_query_xfer)      \
+	X("qSearch",    'S', 'h', ":memory:%;%;", dbg_query_search)    \
+	X("qCRC",       'C', 'C', ":%,%",         dbg_query_crc)       \
+	X("qRcmd",      'R', 'd', ",",            dbg_query_rcmd)
+
+#define DBG_QUERY_HASH(len, second, last) \
+	(((len) * 4 + (second) * 15 + (last)) & 31)
+
+static const dbg_cmd *dbg_query_find(const char *name, size_t len)
 {
-	while (len--) {
-		if (dbg_sys_putchar(*buf++) == EOF) {
-			return EOF;
+	#define DBG_QUERY_CASE(str, second, last, fmt, fn) \
+		case DBG_QUERY_HASH(sizeof(str) - 1, second, last): { \
+			static const dbg_cmd query = { fmt, fn }; \
+			if (len == sizeof(str) - 1 && !memcmp(name, str, len)) { \
+				return &query; \
+			} \
+			return NULL; \
 		}
+
+	if (len < 2) {
+		return NULL;
+	}
+	switch (DBG_QUERY_HASH(len, name[1], name[len-1])) {
+	DBG_QUERIES(DBG_QUERY_CASE)
 	}
+	return NULL;
 
-	return 0;
+	#undef DBG_QUERY_CASE
 }
 
 /*
- * Read a sequence of bytes.
- *
- * Returns:
- *    0   if successfully read len bytes
- *    EOF if failed to read all bytes
+ * Dispatch a q or Q packet on its name.  Unknown queries get an empty reply.
  */
-int dbg_read(char *buf, size_t buf_len, size_t len)
+static int dbg_cmd_query(dbg_args *args)
 {
-	char c;
-
-	if (buf_len < len) {
-		/* Buffer too small */
-		return EOF;
-	}
+	const dbg_cmd *query;
+	const char *name = args->buf;
+	size_t len;
 
-	while (len--) {
-		if ((c = dbg_sys_getc()) == EOF) {
-			return EOF;
+	for (len = 0; &name[len] < args->end; len++) {
+		if (name[len] == ':' || name[len] == ',' || name[len] == ';') {
+			break;
 		}
-		*buf++ = c;
 	}
-
-	return 0;
-}
-
-
-static uint64_t u32_to_hex(uint32_t i) {
-	char buff[9];
-	uint8_t *src = (uint8_t *)&i;
-	sprintf(buff, "%02x%02x%02x%02x", src[0], src[1], src[2], src[3]);
-	return *(uint64_t*)buff;
-}
-
-static uint32_t hex_to_u32(uint64_t i) {
-	char buff[9];
-	*(uint64_t*)buff = i;
-	buff[9] = 0;
-	uint32_t x;
-	sscanf(buff, "%x", &x);
-	return x;
+	query = dbg_query_find(name, len);
+	if (!query) {
+		dbg_send_packet(NULL, 0);
+		return 0;
+	}
+	args->next = &name[len];
+	if (dbg_args_parse(args, query->fmt) == EOF) {
+		return EOF;
+	}
+	return query->fn(args);
 }
 
 /*****************************************************************************
@@ -760,19 +2676,21 @@ static uint32_t hex_to_u32(uint64_t i) {
  */
 int dbg_main(struct dbg_state *state)
 {
-	address     addr;
-	char        pkt_buf[1024];
-	int         status;
-	size_t      length;
-	size_t      pkt_len;
-	const char *ptr_next;
-
-//	dbg_send_signal_packet(pkt_buf, sizeof(pkt_buf), 0);
+	char           pkt_buf[DBG_PKT_SIZE];
+	const dbg_cmd *cmd;
+	dbg_args       args;
+	size_t         pkt_len;
 
+	dbg_detached = 0;
 	while (1) {
+		/* The last packet has been handled, whichever way it went */
+		dbg_stats_end();
+		if (dbg_detached) {
+			break;
+		}
+
 		/* Receive the next packet */
-		status = dbg_recv_packet(pkt_buf, sizeof(pkt_buf), &pkt_len);
-		if (status == EOF) {
+		if (dbg_recv_packet(pkt_buf, sizeof(pkt_buf), &pkt_len) == EOF) {
 			break;
 		}
 
@@ -780,247 +2698,24 @@ int dbg_main(struct dbg_state *state)
 			/* Received empty packet.. */
 			continue;
 		}
+		dbg_stats_begin(pkt_buf, pkt_len);
 
-		ptr_next = pkt_buf;
-
-		/*
-		 * Handle one letter commands
-		 */
-		switch (pkt_buf[0]) {
-
-		/* Calculate remaining space in packet from ptr_next position. */
-		#define token_remaining_buf (pkt_len-(ptr_next-pkt_buf))
-
-		/* Expecting a seperator. If not present, go to error */
-		#define token_expect_seperator(c) \
-			{ \
-				if (!ptr_next || *ptr_next != c) { \
-					goto error; \
-				} else { \
-					ptr_next += 1; \
-				} \
-			}
-
-		/* Expecting an integer argument. If not present, go to error */
-		#define token_expect_integer_arg(arg) \
-			{ \
-				arg = dbg_strtol(ptr_next, token_remaining_buf, \
-				                 16, &ptr_next); \
-				if (!ptr_next) { \
-					goto error; \
-				} \
-			}
-
-		/* Query supported */
-		case 'q':
-			if (!strncmp(&pkt_buf[1], "Supported", 9)) {
-				dbg_send_packet_string("swbreak+;hwbreak+;PacketSize=FF");
-			} else if (!strncmp(&pkt_buf[1],  "Attached", 8)) {
-				dbg_send_packet_string("1");
-			} else {
-				dbg_send_packet_string("");
-			}
-			break;
-		/*
-		 * Read Registers
-		 * Command Format: g
-		 */
-		case 'g': {
-			/* Encode registers */
-			uint64_t *ptr = (uint64_t *)pkt_buf;
-			ptr[0] = u32_to_hex(state->regs.pc);
-			for (int i=1; i<=35; i++) ptr[i] = 0x7878787878787878; // xxxx
-			ptr[36] = u32_to_hex(state->regs.sar);
-			ptr[37] = u32_to_hex(state->regs.litbase);
-			for (int i=38; i<=39; i++) ptr[i] = 0x7878787878787878; // xxxx
-			ptr[40] = u32_to_hex(state->regs.sr176);
-			for (int i=41; i<=41; i++) ptr[i] = 0x7878787878787878; // xxxx
-			ptr[42] = u32_to_hex(state->regs.ps);
-			for (int i=43; i<=96; i++) ptr[i] = 0x7878787878787878; // xxxx
-			for (int i=0; i<16; i++) ptr[97+i] = u32_to_hex(state->regs.a[i]);
-			pkt_len = 113 * sizeof(uint64_t);
-			dbg_send_packet(pkt_buf, pkt_len);
-			  }
-			break;
-		
-		/*
-		 * Write Registers
-		 * Command Format: G XX...
-		 */
-		case 'G': {
-			/* De registers */
-			uint64_t *ptr = (uint64_t *)pkt_buf;
-			state->regs.pc = hex_to_u32(ptr[0]);
-			state->regs.sar = hex_to_u32(ptr[36]);
-			state->regs.litbase = hex_to_u32(ptr[37]);
-			state->regs.sr176 = hex_to_u32(ptr[40]);
-			state->regs.ps = hex_to_u32(ptr[42]);
-			for (int i=0; i<16; i++) state->regs.a[i] = hex_to_u32(ptr[97+i]);
-			dbg_send_ok_packet(pkt_buf, sizeof(pkt_buf));
-			  }
-			break;
-
-		/*
-		 * Read a Register
-		 * Command Format: p n
-		 */
-		case 'p':
-			ptr_next += 1;
-			token_expect_integer_arg(addr);
-
-			uint64_t *p = (uint64_t *)pkt_buf;
-			switch (addr) {
-				case 0: *p = u32_to_hex(state->regs.pc); break;
-				case 36: *p = u32_to_hex(state->regs.sar); break;
-				case 37: *p = u32_to_hex(state->regs.litbase); break;
-				case 40: *p = u32_to_hex(state->regs.sr176); break;
-				case 42: *p = u32_to_hex(state->regs.ps); break;
-				case 97: *p = u32_to_hex(state->regs.a[0]); break;
-				case 98: *p = u32_to_hex(state->regs.a[1]); break;
-				case 99: *p = u32_to_hex(state->regs.a[2]); break;
-				case 100: *p = u32_to_hex(state->regs.a[3]); break;
-				case 101: *p = u32_to_hex(state->regs.a[4]); break;
-				case 102: *p = u32_to_hex(state->regs.a[5]); break;
-				case 103: *p = u32_to_hex(state->regs.a[6]); break;
-				case 104: *p = u32_to_hex(state->regs.a[7]); break;
-				case 105: *p = u32_to_hex(state->regs.a[8]); break;
-				case 106: *p = u32_to_hex(state->regs.a[9]); break;
-				case 107: *p = u32_to_hex(state->regs.a[10]); break;
-				case 108: *p = u32_to_hex(state->regs.a[11]); break;
-				case 109: *p = u32_to_hex(state->regs.a[12]); break;
-				case 110: *p = u32_to_hex(state->regs.a[13]); break;
-				case 111: *p = u32_to_hex(state->regs.a[14]); break;
-				case 112: *p = u32_to_hex(state->regs.a[15]); break;
-				default: *p = 0x7878787878787878; break;
-			}
-			dbg_send_packet(pkt_buf, sizeof(uint64_t));
-			goto error;
-			break;
-		
-		/*
-		 * Write a Register
-		 * Command Format: P n...=r...
-		 */
-		case 'P':
-#if 0
-			ptr_next += 1;
-			token_expect_integer_arg(addr);
-			token_expect_seperator('=');
-
-			if (addr >= DBG_NUM_REGISTERS) {
-				goto error;
-			}
-
-			status = dbg_dec_hex(ptr_next, token_remaining_buf,
-			                     (char *)&(state->registers[addr]),
-			                     sizeof(state->registers[addr]));
-			if (status == EOF) {
-				goto error;
-			}
-			dbg_send_ok_packet(pkt_buf, sizeof(pkt_buf));
-#endif
-			goto error;
-			break;
-		
-		/*
-		 * Read Memory
-		 * Command Format: m addr,length
-		 */
-		case 'm':
-			ptr_next += 1;
-			token_expect_integer_arg(addr);
-			token_expect_seperator(',');
-			token_expect_integer_arg(length);
-
-			/* Read Memory */
-			status = dbg_mem_read(pkt_buf, sizeof(pkt_buf),
-			                      addr, length, dbg_enc_hex);
-			if (status == EOF) {
-				goto error;
-			}
-			dbg_send_packet(pkt_buf, status);
-			break;
-		
-		/*
-		 * Write Memory
-		 * Command Format: M addr,length:XX..
-		 */
-		case 'M':
-			ptr_next += 1;
-			token_expect_integer_arg(addr);
-			token_expect_seperator(',');
-			token_expect_integer_arg(length);
-			token_expect_seperator(':');
-
-			/* Write Memory */
-			status = dbg_mem_write(ptr_next, token_remaining_buf,
-			                       addr, length, dbg_dec_hex);
-			if (status == EOF) {
-				goto error;
-			}
-			dbg_send_ok_packet(pkt_buf, sizeof(pkt_buf));
-			break;
-
-		/*
-		 * Write Memory (Binary)
-		 * Command Format: X addr,length:XX..
-		 */
-		case 'X':
-			ptr_next += 1;
-			token_expect_integer_arg(addr);
-			token_expect_seperator(',');
-			token_expect_integer_arg(length);
-			token_expect_seperator(':');
-
-			/* Write Memory */
-			status = dbg_mem_write(ptr_next, token_remaining_buf,
-			                       addr, length, dbg_dec_bin);
-			if (status == EOF) {
-				goto error;
-			}
-			dbg_send_ok_packet(pkt_buf, sizeof(pkt_buf));
-			break;
-
-		case 'D':
-			dbg_send_ok_packet(NULL, 0);
-			exit(0);
-			break;
-
-		/* 
-		 * Continue
-		 * Command Format: c [addr]
-		 */
-		case 'c':
-			dbg_continue();
-			return 0;
-
-		/*
-		 * Single-step
-		 * Command Format: s [addr]
-		 */
-		case 's':
-			dbg_step();
-			return 0;
-
-		case '?':
-			dbg_send_signal_packet(pkt_buf, sizeof(pkt_buf), 0);
-			break;
-
-		/*
-		 * Unsupported Command
-		 */
-		default:
+		cmd = ((unsigned char)pkt_buf[0] < 128) ? &dbg_cmds[(int)pkt_buf[0]] : NULL;
+		if (!cmd || !cmd->fn) {
+			/* Unsupported Command */
 			dbg_send_packet(NULL, 0);
+			continue;
 		}
 
-		continue;
-
-	error:
-		dbg_send_error_packet(pkt_buf, sizeof(pkt_buf), 0x00);
-
-		#undef token_remaining_buf
-		#undef token_expect_seperator
-		#undef token_expect_integer_arg
+		args.state    = state;
+		args.buf      = pkt_buf;
+		args.buf_size = sizeof(pkt_buf);
+		args.next     = &pkt_buf[1];
+		args.end      = &pkt_buf[pkt_len];
+		args.num      = 0;
+		if (dbg_args_parse(&args, cmd->fmt) == EOF || cmd->fn(&args) == EOF) {
+			dbg_send_error_packet(pkt_buf, sizeof(pkt_buf), 0x00);
+		}
 	}
 
 	return 0;
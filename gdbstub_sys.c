@@ -23,21 +23,149 @@
 #include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <signal.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <elf.h>
 #include <libelf.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#define DBG_IO_URING 1
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#endif
+#endif
+
 // Static ensures all fields are initted to 0, so no need to check later on
 static struct dbg_state dbg_state;
 
 #define RAMSTART 0x3FFE8000
 #define RAMLEN   (0x14000 + 0x4000)
+#define RAMFILL  0xec
+
+/* Shared backing for pages which are entirely zero or entirely RAMFILL */
+static const uint8_t zero_page[DBG_PAGE_SIZE];
+static const uint8_t fill_page[DBG_PAGE_SIZE] = { [0 ... DBG_PAGE_SIZE-1] = RAMFILL };
+
+static int dbg_page_shared(const uint8_t *page)
+{
+	return (page == zero_page) || (page == fill_page);
+}
+
+/*
+ * Return the shared page with the same contents as data, or NULL if data is
+ * not entirely zero or entirely RAMFILL.
+ */
+static uint8_t *dbg_page_uniform(const uint8_t *data, size_t len)
+{
+	const uint8_t *page = (data[0] == 0) ? zero_page :
+	                      (data[0] == RAMFILL) ? fill_page : NULL;
+	if (!page || memcmp(data, page, len)) {
+		return NULL;
+	}
+	return (uint8_t *)page;
+}
+
+#define ARENA_BLOCK (64 * 1024)
+#define ARENA_ALIGN 16
+
+typedef struct dbg_arena_block {
+	struct dbg_arena_block *next;
+	size_t                  size;
+	size_t                  used;
+	size_t                  pad;   /* Keeps data ARENA_ALIGN aligned */
+	uint8_t                 data[];
+} dbg_arena_block;
+
+/*
+ * Allocate size zeroed bytes, which live until the arena is released.
+ * Allocations too big to share a block get one of their own.
+ */
+void *dbg_arena_alloc(dbg_arena *arena, size_t size)
+{
+	dbg_arena_block *block = arena->blocks;
+
+	size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+	if (!block || (block->size - block->used < size)) {
+		size_t block_size = (size > ARENA_BLOCK / 4) ? size : ARENA_BLOCK;
+		block = (dbg_arena_block*)calloc(1, sizeof(dbg_arena_block) + block_size);
+		block->size = block_size;
+		arena->bytes += block_size;
+		if ((size > ARENA_BLOCK / 4) && arena->blocks) {
+			/* Keep filling the current block */
+			block->next = arena->blocks->next;
+			arena->blocks->next = block;
+		} else {
+			block->next = arena->blocks;
+			arena->blocks = block;
+		}
+	}
+	block->used += size;
+	return block->data + block->used - size;
+}
+
+/*
+ * Allocate a page, reusing one given back if there is one.  Its contents
+ * are undefined.
+ */
+uint8_t *dbg_arena_page(dbg_arena *arena)
+{
+	void *page = arena->free_pages;
+	if (page) {
+		memcpy(&arena->free_pages, page, sizeof(void *));
+		return (uint8_t *)page;
+	}
+	return (uint8_t *)dbg_arena_alloc(arena, DBG_PAGE_SIZE);
+}
+
+void dbg_arena_free_page(dbg_arena *arena, uint8_t *page)
+{
+	memcpy(page, &arena->free_pages, sizeof(void *));
+	arena->free_pages = page;
+}
+
+static void dbg_arena_release(dbg_arena *arena)
+{
+	dbg_arena_block *block, *next;
+	for (block = arena->blocks; block; block = next) {
+		next = block->next;
+		free(block);
+	}
+	memset(arena, 0, sizeof(*arena));
+}
 
-void add_mem_region(uint32_t base, uint32_t size, uint8_t *data)
+/*
+ * Add a region whose pages all start out as the shared page for fill, which
+ * must be 0 or RAMFILL.
+ */
+mem_region *add_mem_region(uint32_t base, uint32_t size, uint32_t flags, uint8_t fill)
 {
-	mem_region *mem = (mem_region*)malloc(sizeof(mem_region));
+	mem_region *mem = (mem_region*)dbg_arena_alloc(&dbg_state.arena, sizeof(mem_region));
+	uint32_t num_pages = DBG_NUM_PAGES(base, size);
 	mem->base = base;
 	mem->size = size;
-	mem->data = data;
+	mem->flags = flags;
+	mem->pages = (uint8_t**)dbg_arena_alloc(&dbg_state.arena, num_pages * sizeof(uint8_t *));
+	for (uint32_t i=0; i<num_pages; i++) {
+		mem->pages[i] = (uint8_t *)(fill ? fill_page : zero_page);
+	}
 	mem->next = NULL;
+	mem->src = DBG_SRC_NONE;
+	mem->src_fd = -1;
+	mem->src_len = size;
+	mem->src_offs = NULL;
+	mem->src_map = NULL;
+	mem->lru = NULL;
 	if (!dbg_state.memory) {
 		dbg_state.memory = mem;
 	} else {
@@ -47,21 +175,627 @@ void add_mem_region(uint32_t base, uint32_t size, uint8_t *data)
 		}
 		here->next = mem;
 	}
+	return mem;
 }
 
-void dbg_sys_load(const char *fname)
+/*
+ * Memory budget.  Private pages which were never written and can be read
+ * back from their region's source are kept on an LRU list; when the
+ * private pages would exceed the budget, the least recently used of them
+ * are dropped.  Written pages and pages without a source stay resident
+ * but count against the budget.
+ */
+typedef struct mem_lru {
+	struct mem_lru    *prev;  /* NULL when not on the list */
+	struct mem_lru    *next;
+	struct mem_region *mem;
+} mem_lru;
+
+static mem_lru  dbg_lru = { &dbg_lru, &dbg_lru, NULL };
+static uint32_t dbg_lru_len;      /* Clean pages on the list */
+static uint32_t dbg_pinned;       /* Private pages which can't be evicted */
+static uint32_t dbg_budget_pages; /* 0 for no budget */
+
+static struct {
+	uint64_t hits;
+	uint64_t reloads;
+	uint64_t evictions;
+} dbg_budget_stats;
+
+static void dbg_lru_unlink(mem_lru *node)
+{
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = node->next = NULL;
+	dbg_lru_len--;
+}
+
+static void dbg_lru_push(mem_lru *node)
+{
+	node->prev = &dbg_lru;
+	node->next = dbg_lru.next;
+	dbg_lru.next->prev = node;
+	dbg_lru.next = node;
+	dbg_lru_len++;
+}
+
+/*
+ * Drop least recently used clean pages until there is room for one more
+ * private page.  The most recently used page is always kept, as a caller
+ * may still hold it while asking for the next.
+ */
+static void dbg_budget_reserve(void)
+{
+	while ((dbg_lru_len + dbg_pinned >= dbg_budget_pages) && (dbg_lru_len > 1)) {
+		mem_lru *node = dbg_lru.prev;
+		mem_region *mem = node->mem;
+		uint32_t n = node - mem->lru;
+		address addr = ((mem->base >> DBG_PAGE_SHIFT) + n) << DBG_PAGE_SHIFT;
+
+		dbg_lru_unlink(node);
+		if (mem->src == DBG_SRC_MAP) {
+			/* Clean, so the kernel reads it back from the sidecar */
+			madvise(mem->pages[n], DBG_PAGE_SIZE, MADV_DONTNEED);
+		} else {
+			dbg_arena_free_page(&dbg_state.arena, mem->pages[n]);
+		}
+		mem->pages[n] = NULL;
+		xt_invalidate(&dbg_state, addr);
+		dbg_budget_stats.evictions++;
+	}
+}
+
+static int hex_nibble(int ch)
+{
+	if ((ch >= '0') && (ch <= '9')) {
+		return ch - '0';
+	}
+	ch |= 0x20;
+	return ((ch >= 'a') && (ch <= 'f')) ? ch - 'a' + 10 : -1;
+}
+
+/*
+ * Read an evicted page back from its region's source.
+ */
+static void dbg_mem_reload(mem_region *mem, uint32_t n)
+{
+	address page_addr = ((mem->base >> DBG_PAGE_SHIFT) + n) << DBG_PAGE_SHIFT;
+	address start = (page_addr > mem->base) ? page_addr : mem->base;
+	address end = page_addr + DBG_PAGE_SIZE;
+	uint32_t in_page = start & DBG_PAGE_MASK;
+	uint8_t *page;
+	int ok = 0;
+
+	if (end - mem->base > mem->src_len) {
+		end = mem->base + mem->src_len;
+	}
+	if (mem->src == DBG_SRC_MAP) {
+		mem->pages[n] = mem->src_map + mem->src_offs[n];
+		return;
+	}
+
+	page = dbg_arena_page(&dbg_state.arena);
+	memset(page, 0, DBG_PAGE_SIZE);
+	if (mem->src == DBG_SRC_FILE) {
+		ok = (pread(mem->src_fd, page + in_page, end - start, mem->src_offs[n]) ==
+		      (ssize_t)(end - start));
+	} else if (mem->src == DBG_SRC_HEX) {
+		/* Two digits a byte, split into lines */
+		char text[4 * DBG_PAGE_SIZE];
+		ssize_t len = pread(mem->src_fd, text, sizeof(text), mem->src_offs[n]);
+		uint32_t pos = in_page;
+		for (ssize_t i = 0; (i + 1 < len) && (pos < end - page_addr); i++) {
+			int hi = hex_nibble(text[i]), lo;
+			if (hi < 0) {
+				continue;
+			}
+			if ((lo = hex_nibble(text[++i])) < 0) {
+				break;
+			}
+			page[pos++] = (hi << 4) | lo;
+		}
+		ok = (pos == end - page_addr);
+	}
+	if (!ok) {
+		fprintf(stderr, "Can't read back the page at %08x, its source has changed\n",
+		        page_addr);
+		exit(1);
+	}
+	mem->pages[n] = page;
+}
+
+/*
+ * Note a use of page n of mem under a budget, reading it back first if it
+ * was evicted.
+ */
+static uint8_t *dbg_mem_page_use(mem_region *mem, uint32_t n)
+{
+	mem_lru *node = &mem->lru[n];
+
+	if (!mem->pages[n]) {
+		dbg_budget_reserve();
+		dbg_mem_reload(mem, n);
+		dbg_lru_push(node);
+		dbg_budget_stats.reloads++;
+	} else if (node->prev) {
+		if (dbg_lru.next != node) {
+			dbg_lru_unlink(node);
+			dbg_lru_push(node);
+		}
+		dbg_budget_stats.hits++;
+	}
+	return mem->pages[n];
+}
+
+/*
+ * Get page n of mem for reading.
+ */
+static inline uint8_t *dbg_mem_page(mem_region *mem, uint32_t n)
+{
+	if (mem->lru) {
+		return dbg_mem_page_use(mem, n);
+	}
+	return mem->pages[n];
+}
+
+/*
+ * Start holding private pages to budget bytes, evicting at once if they
+ * are over it already.
+ */
+static void dbg_budget_start(size_t budget)
+{
+	dbg_budget_pages = budget / DBG_PAGE_SIZE;
+	if (dbg_budget_pages < 2) {
+		dbg_budget_pages = 2;
+	}
+	for (mem_region *mem = dbg_state.memory; mem; mem = mem->next) {
+		uint32_t num_pages = DBG_NUM_PAGES(mem->base, mem->size);
+		mem->lru = (mem_lru*)dbg_arena_alloc(&dbg_state.arena, num_pages * sizeof(mem_lru));
+		for (uint32_t n = 0; n < num_pages; n++) {
+			mem->lru[n].mem = mem;
+			if (dbg_page_shared(mem->pages[n])) {
+				continue;
+			} else if (mem->src == DBG_SRC_NONE) {
+				dbg_pinned++;
+			} else {
+				dbg_lru_push(&mem->lru[n]);
+			}
+		}
+	}
+	dbg_budget_reserve();
+}
+
+/*
+ * Print memory budget statistics.
+ */
+void dbg_sys_stats(FILE *fp)
+{
+	if (!dbg_budget_pages) {
+		return;
+	}
+	fprintf(fp, "memory: %u of %u pages resident, %u clean, %llu hits, %llu reloads, %llu evictions\n",
+	        dbg_lru_len + dbg_pinned, dbg_budget_pages, dbg_lru_len,
+	        (unsigned long long)dbg_budget_stats.hits,
+	        (unsigned long long)dbg_budget_stats.reloads,
+	        (unsigned long long)dbg_budget_stats.evictions);
+}
+
+/*
+ * Get a writable pointer to the page holding addr, giving it a private copy
+ * first if it is still shared.  Under a budget the page is pinned from now
+ * on, and a page in the sidecar mapping is copied out of it so the mapping
+ * stays clean.
+ */
+uint8_t *dbg_mem_page_rw(mem_region *mem, address addr)
+{
+	uint32_t n = DBG_PAGE_INDEX(mem, addr);
+	uint8_t **page = &mem->pages[n];
+
+	if (mem->lru) {
+		mem_lru *node = &mem->lru[n];
+		if (!*page || dbg_page_shared(*page)) {
+			dbg_budget_reserve();
+		}
+		dbg_mem_page(mem, n);
+		if (node->prev) {
+			dbg_lru_unlink(node);
+			dbg_pinned++;
+			if (mem->src == DBG_SRC_MAP) {
+				uint8_t *copy = dbg_arena_page(&dbg_state.arena);
+				memcpy(copy, *page, DBG_PAGE_SIZE);
+				madvise(*page, DBG_PAGE_SIZE, MADV_DONTNEED);
+				*page = copy;
+			}
+			return *page;
+		}
+		if (dbg_page_shared(*page)) {
+			dbg_pinned++;
+		}
+	}
+	if (dbg_page_shared(*page)) {
+		uint8_t *copy = dbg_arena_page(&dbg_state.arena);
+		memcpy(copy, *page, DBG_PAGE_SIZE);
+		*page = copy;
+	}
+	return *page;
+}
+
+/*
+ * Copy len bytes of data into a freshly added region at addr.  Pages whose
+ * part inside the region is covered completely keep pointing at a shared
+ * page when the data is uniform, so only real contents get allocated.
+ */
+static void dbg_mem_load(mem_region *mem, address addr, const uint8_t *data, uint32_t len)
+{
+	while (len) {
+		uint32_t in_page = addr & DBG_PAGE_MASK;
+		uint32_t chunk = DBG_PAGE_SIZE - in_page;
+		uint8_t **page = &mem->pages[DBG_PAGE_INDEX(mem, addr)];
+		uint8_t *shared;
+
+		if (chunk > len) {
+			chunk = len;
+		}
+		// Starts at the page or region start, ends at the page or region end
+		int whole = ((in_page == 0) || (addr == mem->base)) &&
+		            ((chunk == DBG_PAGE_SIZE - in_page) ||
+		             (addr + chunk == mem->base + mem->size));
+		if (whole && dbg_page_shared(*page) &&
+		    (shared = dbg_page_uniform(data, chunk))) {
+			*page = shared;
+		} else {
+			memcpy(dbg_mem_page_rw(mem, addr) + in_page, data, chunk);
+		}
+		addr += chunk;
+		data += chunk;
+		len -= chunk;
+	}
+}
+
+static int write_all(int fd, const void *buf, size_t len)
+{
+	const uint8_t *ptr = (const uint8_t *)buf;
+	while (len) {
+		ssize_t ret = write(fd, ptr, len);
+		if (ret <= 0) {
+			return -1;
+		}
+		ptr += ret;
+		len -= ret;
+	}
+	return 0;
+}
+
+/*
+ * Startup phases recorded for --timings, each with its start and length in
+ * ms since the stub started and the peak RSS when it ended.  Sub-phases are
+ * named after their phase, as in "log" and "log.core".
+ */
+typedef struct dbg_phase {
+	char   name[64];
+	double start;
+	double ms;
+	long   peak_rss_kb;
+} dbg_phase;
+
+#define DBG_MAX_PHASES 64
+
+static int             dbg_timings;  /* 0 off, 1 text, 2 JSON */
+static struct timespec dbg_timing_base;
+static dbg_phase       dbg_phases[DBG_MAX_PHASES];
+static int             dbg_num_phases;
+
+static double dbg_timing_ms(const struct timespec *ts)
+{
+	return (ts->tv_sec - dbg_timing_base.tv_sec) * 1e3 +
+	       (ts->tv_nsec - dbg_timing_base.tv_nsec) / 1e6;
+}
+
+static double dbg_timing_now(void)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return dbg_timing_ms(&now);
+}
+
+static void dbg_phase_add(const char *name, double start, double ms)
+{
+	struct rusage ru;
+	dbg_phase *phase;
+
+	if (!dbg_timings || dbg_num_phases == DBG_MAX_PHASES) {
+		return;
+	}
+	phase = &dbg_phases[dbg_num_phases++];
+	snprintf(phase->name, sizeof(phase->name), "%s", name);
+	phase->start = start;
+	phase->ms = ms;
+	getrusage(RUSAGE_SELF, &ru);
+	phase->peak_rss_kb = ru.ru_maxrss;
+}
+
+/*
+ * Record a phase which began at start and ends now.
+ */
+static void dbg_phase_end(const char *name, double start)
+{
+	dbg_phase_add(name, start, dbg_timing_now() - start);
+}
+
+/*
+ * Print the recorded phases, the first packet's service, and how much of
+ * the loaded memory has private pages, on stderr.
+ */
+static void dbg_timings_report(void)
+{
+	uint64_t arrival, done;
+	uint32_t pages = 0, private_pages = 0;
+	int regions = 0;
+	int json = (dbg_timings == 2);
+
+	if (dbg_num_phases && !dbg_stats_first_packet(&arrival, &done)) {
+		/* The last phase is the whole startup */
+		double ready = dbg_phases[dbg_num_phases-1].ms;
+		struct timespec ts = { arrival / 1000000000, arrival % 1000000000 };
+		double start = dbg_timing_ms(&ts);
+		dbg_phase_add("first_packet.wait", ready, start - ready);
+		dbg_phase_add("first_packet.service", start, (done - arrival) / 1e6);
+	}
+
+	for (mem_region *mem = dbg_state.memory; mem; mem = mem->next) {
+		uint32_t num_pages = DBG_NUM_PAGES(mem->base, mem->size);
+		regions++;
+		pages += num_pages;
+		for (uint32_t i = 0; i < num_pages; i++) {
+			private_pages += mem->pages[i] && !dbg_page_shared(mem->pages[i]);
+		}
+	}
+
+	fprintf(stderr, json ? "{\"phases\":[" : "%-40s %10s %10s %12s\n",
+	        "phase", "start ms", "ms", "peak RSS KB");
+	for (int i = 0; i < dbg_num_phases; i++) {
+		dbg_phase *phase = &dbg_phases[i];
+		fprintf(stderr, json ? "%s{\"name\":\"%s\",\"start_ms\":%.3f,\"ms\":%.3f,\"peak_rss_kb\":%ld}"
+		                     : "%s%-40s %10.3f %10.3f %12ld\n",
+		        (json && i) ? "," : "", phase->name, phase->start, phase->ms,
+		        phase->peak_rss_kb);
+	}
+	fprintf(stderr, json ? "],\"memory\":{\"regions\":%d,\"pages\":%u,\"private_pages\":%u,\"private_kb\":%u}}\n"
+	                     : "memory: %d regions, %u pages, %u private (%u KB)\n",
+	        regions, pages, private_pages, private_pages * (DBG_PAGE_SIZE / 1024));
+}
+
+/*
+ * Binary sidecar written next to a parsed log so later loads of the same log
+ * can skip the text parse and map the dump straight from disk:
+ *   cache_header
+ *   cache_region[num_regions]
+ *   uint32_t page table for each region, DBG_NUM_PAGES(base, size) entries
+ *   padding to CACHE_ALIGN, then the raw pages, CACHE_ALIGN bytes each
+ * A page table entry is CACHE_PAGE_ZERO or CACHE_PAGE_FILL for pages backed
+ * by a shared page, otherwise the file offset of the page's contents.
+ */
+#define CACHE_MAGIC      "XTDUMP03"
+#define CACHE_ALIGN      DBG_PAGE_SIZE
+#define CACHE_PAGE_ZERO  0
+#define CACHE_PAGE_FILL  1
+
+typedef struct cache_header {
+	char      magic[8];
+	uint64_t  log_hash;  /* dbg_hash() of the source log */
+	uint64_t  log_size;
+	registers regs;
+	uint32_t  num_regions;
+	uint32_t  reserved;
+} cache_header;
+
+typedef struct cache_region {
+	uint32_t base;
+	uint32_t size;
+	uint32_t flags;
+	uint32_t pages;      /* offset of the page table, from the start of the file */
+} cache_region;
+
+static int dbg_use_cache = 1;
+
+static uint64_t dbg_hash(const uint8_t *buf, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL ^ len;
+	uint64_t word;
+
+	for (; len >= 8; buf += 8, len -= 8) {
+		memcpy(&word, buf, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+		hash ^= hash >> 29;
+	}
+	while (len--) {
+		hash = (hash ^ *buf++) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+static int dbg_hash_file(const char *fname, uint64_t *hash, uint64_t *size)
+{
+	struct stat st;
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st)) {
+		if (fd >= 0) {
+			close(fd);
+		}
+		return -1;
+	}
+	*size = st.st_size;
+	*hash = dbg_hash(NULL, 0);
+	if (st.st_size) {
+		void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			close(fd);
+			return -1;
+		}
+		*hash = dbg_hash((const uint8_t *)map, st.st_size);
+		munmap(map, st.st_size);
+	}
+	close(fd);
+	return 0;
+}
+
+/*
+ * Map a sidecar and adopt its registers and regions.  The mapping is private
+ * and writable so memory writes from gdb never reach the file.
+ *
+ * Returns 0 on success, -1 if the sidecar is missing, stale or malformed.
+ */
+static int dbg_cache_load(const char *fname, uint64_t hash, uint64_t size)
+{
+	struct stat st;
+	int fd = open(fname, O_RDONLY);
+	if (fd < 0) {
+		return -1;
+	}
+	if (fstat(fd, &st) || (st.st_size < (off_t)sizeof(cache_header))) {
+		close(fd);
+		return -1;
+	}
+	uint8_t *map = (uint8_t*)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+	                              MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		return -1;
+	}
+
+	cache_header *hdr = (cache_header *)map;
+	cache_region *rgn = (cache_region *)(hdr + 1);
+	if (memcmp(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic)) ||
+	    (hdr->log_hash != hash) || (hdr->log_size != size) ||
+	    (sizeof(*hdr) + (uint64_t)hdr->num_regions * sizeof(*rgn) > (uint64_t)st.st_size)) {
+		munmap(map, st.st_size);
+		return -1;
+	}
+	for (uint32_t i=0; i<hdr->num_regions; i++) {
+		uint32_t num_pages = DBG_NUM_PAGES(rgn[i].base, rgn[i].size);
+		uint32_t *pages = (uint32_t *)(map + rgn[i].pages);
+		if ((uint64_t)rgn[i].pages + num_pages * sizeof(uint32_t) > (uint64_t)st.st_size) {
+			munmap(map, st.st_size);
+			return -1;
+		}
+		for (uint32_t n=0; n<num_pages; n++) {
+			if ((pages[n] > CACHE_PAGE_FILL) &&
+			    ((uint64_t)pages[n] + DBG_PAGE_SIZE > (uint64_t)st.st_size)) {
+				munmap(map, st.st_size);
+				return -1;
+			}
+		}
+	}
+
+	dbg_state.regs = hdr->regs;
+	dbg_state.cache_map = map;
+	dbg_state.cache_len = st.st_size;
+	for (uint32_t i=0; i<hdr->num_regions; i++) {
+		uint32_t num_pages = DBG_NUM_PAGES(rgn[i].base, rgn[i].size);
+		uint32_t *pages = (uint32_t *)(map + rgn[i].pages);
+		mem_region *mem = add_mem_region(rgn[i].base, rgn[i].size, rgn[i].flags, 0);
+		mem->src = DBG_SRC_MAP;
+		mem->src_map = map;
+		mem->src_offs = pages;
+		for (uint32_t n=0; n<num_pages; n++) {
+			if (pages[n] == CACHE_PAGE_FILL) {
+				mem->pages[n] = (uint8_t *)fill_page;
+			} else if (pages[n] != CACHE_PAGE_ZERO) {
+				mem->pages[n] = map + pages[n];
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the current regions and registers as a sidecar for the log with the
+ * given hash.  Goes through a temporary file so readers never see a partial
+ * sidecar.  Failure is not fatal; the log is simply parsed again next time.
+ */
+static void dbg_cache_save(const char *fname, uint64_t hash, uint64_t size)
+{
+	char tmp[PATH_MAX];
+	cache_header *hdr;
+	cache_region *rgn;
+	mem_region *mem;
+	uint32_t num_regions = 0, num_pages = 0;
+
+	for (mem = dbg_state.memory; mem; mem = mem->next) {
+		num_regions++;
+		num_pages += DBG_NUM_PAGES(mem->base, mem->size);
+	}
+
+	size_t table_len = sizeof(*hdr) + num_regions * sizeof(*rgn) +
+	                   num_pages * sizeof(uint32_t);
+	uint32_t offset = (table_len + CACHE_ALIGN - 1) & ~(CACHE_ALIGN - 1);
+	uint8_t *table = (uint8_t*)calloc(1, offset);
+
+	hdr = (cache_header *)table;
+	memcpy(hdr->magic, CACHE_MAGIC, sizeof(hdr->magic));
+	hdr->log_hash = hash;
+	hdr->log_size = size;
+	hdr->regs = dbg_state.regs;
+	hdr->num_regions = num_regions;
+
+	rgn = (cache_region *)(hdr + 1);
+	uint32_t *pages = (uint32_t *)(rgn + num_regions);
+	uint32_t data_offset = offset;
+	for (mem = dbg_state.memory; mem; mem = mem->next, rgn++) {
+		rgn->base = mem->base;
+		rgn->size = mem->size;
+		rgn->flags = mem->flags;
+		rgn->pages = (uint8_t *)pages - table;
+		for (uint32_t n=0; n<DBG_NUM_PAGES(mem->base, mem->size); n++) {
+			if (mem->pages[n] == zero_page) {
+				*pages++ = CACHE_PAGE_ZERO;
+			} else if (mem->pages[n] == fill_page) {
+				*pages++ = CACHE_PAGE_FILL;
+			} else {
+				*pages++ = data_offset;
+				data_offset += DBG_PAGE_SIZE;
+			}
+		}
+	}
+
+	int fd = -1;
+	if (snprintf(tmp, sizeof(tmp), "%s.%d", fname, (int)getpid()) < (int)sizeof(tmp)) {
+		fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	}
+	if (fd < 0) {
+		free(table);
+		return;
+	}
+	int ret = write_all(fd, table, offset);
+	for (mem = dbg_state.memory; mem && !ret; mem = mem->next) {
+		for (uint32_t n=0; (n<DBG_NUM_PAGES(mem->base, mem->size)) && !ret; n++) {
+			if (!dbg_page_shared(mem->pages[n])) {
+				ret = write_all(fd, mem->pages[n], DBG_PAGE_SIZE);
+			}
+		}
+	}
+	free(table);
+	if (close(fd) || ret || rename(tmp, fname)) {
+		unlink(tmp);
+	}
+}
+
+static void dbg_sys_parse_log(const char *fname)
 {
 	char buff[256];
 	const char *regs = "---- begin regs ----";
 	const char *mem = "---- begin core ----";
 
 	// Always add the RAM, even if it's not loaded.  We can fill w/data later
-	uint8_t *ram = (uint8_t*)malloc(RAMLEN);
-	memset(ram, 0xec, RAMLEN);
-	add_mem_region(RAMSTART, RAMLEN, ram);
+	mem_region *ram = add_mem_region(RAMSTART, RAMLEN, PF_R | PF_W, RAMFILL);
 
 	FILE *fp = fopen(fname, "r");
+	if (!fp) {
+		perror(fname);
+		exit(1);
+	}
 	while (fgets(buff, sizeof(buff), fp)) {
+		double start = dbg_timing_now();
 		if (!strncmp(buff, regs, strlen(regs))) {
 			fscanf(fp, "%x", &dbg_state.regs.pc);
 			fscanf(fp, "%x", &dbg_state.regs.ps);
@@ -73,51 +807,710 @@ void dbg_sys_load(const char *fname)
 			fscanf(fp, "%x", &dbg_state.regs.litbase);
 			fscanf(fp, "%x", &dbg_state.regs.sr176);
 			fscanf(fp, "%*x"); // SR208
+			dbg_phase_end("log.parse.regs", start);
 		} else if (!strncmp(buff, mem, strlen(mem))) {
+			uint8_t *core = (uint8_t*)malloc(RAMLEN);
+			uint32_t *offs = (uint32_t*)dbg_arena_alloc(&dbg_state.arena,
+			                 DBG_NUM_PAGES(RAMSTART, RAMLEN) * sizeof(uint32_t));
 			for (int i=0; i<RAMLEN; i++ ) {
 				int t;
+				if (!(i & DBG_PAGE_MASK)) {
+					// Where to read the page back from under a budget
+					offs[i >> DBG_PAGE_SHIFT] = ftell(fp);
+				}
 				fscanf(fp, "%02x", &t);
-				ram[i] = t;
+				core[i] = t;
 			}
+			dbg_mem_load(ram, RAMSTART, core, RAMLEN);
+			free(core);
+			ram->src = DBG_SRC_HEX;
+			ram->src_fd = open(fname, O_RDONLY);
+			ram->src_offs = offs;
+			if (ram->src_fd < 0) {
+				ram->src = DBG_SRC_NONE;
+			}
+			dbg_phase_end("log.parse.core", start);
 		}
 	}
+	fclose(fp);
 }
 
 
+/*
+ * Load a crash log, from its sidecar when one matching the log's contents
+ * exists, otherwise by parsing the log and leaving a sidecar behind.
+ */
+void dbg_sys_load(const char *fname)
+{
+	char cache[PATH_MAX];
+	uint64_t hash, size;
+	double start = dbg_timing_now();
+	double t;
+
+	if (dbg_hash_file(fname, &hash, &size)) {
+		perror(fname);
+		exit(1);
+	}
+	dbg_phase_end("log.hash", start);
+	snprintf(cache, sizeof(cache), "%s.cache", fname);
+	t = dbg_timing_now();
+	if (dbg_use_cache && !dbg_cache_load(cache, hash, size)) {
+		dbg_phase_end("log.sidecar_load", t);
+		dbg_phase_end("log", start);
+		return;
+	}
+	t = dbg_timing_now();
+	dbg_sys_parse_log(fname);
+	dbg_phase_end("log.parse", t);
+	if (dbg_use_cache) {
+		t = dbg_timing_now();
+		dbg_cache_save(cache, hash, size);
+		dbg_phase_end("log.sidecar_save", t);
+	}
+	dbg_phase_end("log", start);
+}
+
+/*
+ * Note that the first len bytes of mem can be read back from fd at offset.
+ */
+static void dbg_mem_source(mem_region *mem, int fd, uint32_t offset, uint32_t len)
+{
+	uint32_t num_pages = DBG_NUM_PAGES(mem->base, mem->size);
+	uint32_t *offs = (uint32_t*)dbg_arena_alloc(&dbg_state.arena, num_pages * sizeof(uint32_t));
+
+	for (uint32_t n = 0; n < num_pages; n++) {
+		address page_addr = ((mem->base >> DBG_PAGE_SHIFT) + n) << DBG_PAGE_SHIFT;
+		offs[n] = offset + ((n == 0) ? 0 : page_addr - mem->base);
+	}
+	mem->src = DBG_SRC_FILE;
+	mem->src_fd = fd;
+	mem->src_len = len;
+	mem->src_offs = offs;
+}
+
+/*
+ * Load the ELF's segments as regions.  The file stays open, as pages can be
+ * read back from it under a memory budget.
+ */
 void dbg_sys_load_elf(const char *fname)
 {
+	double start = dbg_timing_now();
 	int fd = open(fname, O_RDONLY);
 	elf_version(EV_CURRENT);
 	Elf *elf = elf_begin(fd, ELF_C_READ, NULL);
 	Elf32_Ehdr *ehdr = elf32_getehdr(elf);
 	Elf32_Phdr *phdr = elf32_getphdr(elf);
+	dbg_phase_end("elf.headers", start);
 	for (int i=0; i<ehdr->e_phnum; i++) {
-		if (phdr[i].p_vaddr) {
-			uint8_t *mem = (uint8_t*)malloc(phdr[i].p_memsz);
-			pread(fd, mem, phdr[i].p_memsz, phdr[i].p_offset);
-			add_mem_region(phdr[i].p_vaddr, phdr[i].p_memsz, mem);
+		if (phdr[i].p_vaddr && phdr[i].p_memsz) {
+			char name[64];
+			double t = dbg_timing_now();
+			// Anything past p_filesz (e.g. .bss) stays on the shared zero page
+			mem_region *mem = add_mem_region(phdr[i].p_vaddr, phdr[i].p_memsz,
+			                                 phdr[i].p_flags, 0);
+			uint8_t *data = (uint8_t*)malloc(phdr[i].p_filesz);
+			if (pread(fd, data, phdr[i].p_filesz, phdr[i].p_offset) == phdr[i].p_filesz) {
+				dbg_mem_load(mem, phdr[i].p_vaddr, data, phdr[i].p_filesz);
+				dbg_mem_source(mem, fd, phdr[i].p_offset, phdr[i].p_filesz);
+			}
+			free(data);
+			snprintf(name, sizeof(name), "elf.segment%d %08x+%x", i,
+			         phdr[i].p_vaddr, phdr[i].p_memsz);
+			dbg_phase_end(name, t);
+		}
+	}
+	elf_end(elf);
+	dbg_phase_end("elf", start);
+}
+
+/*
+ * Release everything held for the dump in dbg_state: its arena, which has
+ * the regions, pages and emulator state, the sidecar mapping, the files
+ * pages are read back from and the page LRU.  dbg_state is left empty,
+ * ready for dbg_sys_load to load another dump.
+ */
+void dbg_state_destroy(void)
+{
+	struct dbg_state *state = &dbg_state;
+
+	for (mem_region *mem = state->memory; mem; mem = mem->next) {
+		mem_region *here = state->memory;
+		/* Segments of one ELF share its descriptor */
+		while ((here != mem) && (here->src_fd != mem->src_fd)) {
+			here = here->next;
+		}
+		if ((here == mem) && (mem->src_fd >= 0)) {
+			close(mem->src_fd);
+		}
+	}
+	if (state->cache_map) {
+		munmap(state->cache_map, state->cache_len);
+	}
+	dbg_lru.prev = dbg_lru.next = &dbg_lru;
+	dbg_lru_len = 0;
+	dbg_pinned = 0;
+	dbg_budget_pages = 0;
+	dbg_arena_release(&state->arena);
+	memset(state, 0, sizeof(*state));
+}
+
+/*
+ * Register set as laid out in an Xtensa NT_PRSTATUS note, matching
+ * xtensa_elf_gregset_t in gdb.  The LX106 has no register windows, so
+ * a0..a15 are ar0..ar15 with WINDOWBASE fixed at 0.
+ */
+typedef struct xtensa_gregset {
+	uint32_t pc;
+	uint32_t ps;
+	uint32_t lbeg;
+	uint32_t lend;
+	uint32_t lcount;
+	uint32_t sar;
+	uint32_t windowstart;
+	uint32_t windowbase;
+	uint32_t threadptr;
+	uint32_t reserved[7+48];
+	uint32_t ar[64];
+} xtensa_gregset;
+
+/* struct elf_prstatus for a 32-bit target */
+typedef struct xtensa_prstatus {
+	int32_t  si_signo;
+	int32_t  si_code;
+	int32_t  si_errno;
+	int16_t  cursig;
+	uint16_t pad;
+	uint32_t sigpend;
+	uint32_t sighold;
+	int32_t  pid;
+	int32_t  ppid;
+	int32_t  pgrp;
+	int32_t  sid;
+	uint32_t times[8]; /* utime, stime, cutime, cstime */
+	xtensa_gregset reg;
+	int32_t  fpvalid;
+} xtensa_prstatus;
+
+typedef struct xtensa_core_note {
+	Elf32_Nhdr      nhdr;
+	char            name[8]; /* "CORE", padded to 4 bytes */
+	xtensa_prstatus prstatus;
+} xtensa_core_note;
+
+/*
+ * Regions which are completely covered by an earlier region can never be
+ * returned by dbg_find_mem, so they are not part of the visible memory.
+ */
+static int dbg_mem_shadowed(mem_region *mem)
+{
+	mem_region *here;
+	for (here = dbg_state.memory; here != mem; here = here->next) {
+		if ((mem->base >= here->base) &&
+		    (mem->base + mem->size <= here->base + here->size)) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+#define WRITE_IOV 256
+
+/*
+ * Write a region's contents, gathering up to WRITE_IOV pages per writev.
+ */
+static int write_region(int fd, mem_region *mem)
+{
+	struct iovec iov[WRITE_IOV];
+	uint32_t num_pages = DBG_NUM_PAGES(mem->base, mem->size);
+	uint32_t n = 0;
+
+	while (n < num_pages) {
+		int cnt = 0;
+		size_t len = 0;
+		for (; (n < num_pages) && (cnt < WRITE_IOV); n++, cnt++) {
+			uint32_t start = (n == 0) ? mem->base & DBG_PAGE_MASK : 0;
+			uint32_t end = (n == num_pages - 1) ?
+			               ((mem->base + mem->size - 1) & DBG_PAGE_MASK) + 1 : DBG_PAGE_SIZE;
+			iov[cnt].iov_base = mem->pages[n] + start;
+			iov[cnt].iov_len = end - start;
+			len += iov[cnt].iov_len;
+		}
+		ssize_t ret = writev(fd, iov, cnt);
+		if (ret < 0) {
+			return -1;
+		}
+		if ((size_t)ret != len) {
+			// Short write, finish off the batch the slow way
+			for (int i=0; i<cnt; i++) {
+				if ((size_t)ret >= iov[i].iov_len) {
+					ret -= iov[i].iov_len;
+					continue;
+				}
+				if (write_all(fd, (uint8_t *)iov[i].iov_base + ret, iov[i].iov_len - ret)) {
+					return -1;
+				}
+				ret = 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the loaded dump as an ELF ET_CORE file: a PT_NOTE with the
+ * registers followed by one PT_LOAD per visible memory region.  All headers
+ * are built up front so the file goes out in one pass, one write per region.
+ */
+int dbg_sys_write_core(const char *fname)
+{
+	mem_region *mem;
+	int phnum = 1;
+	for (mem = dbg_state.memory; mem; mem = mem->next) {
+		if (!dbg_mem_shadowed(mem)) {
+			phnum++;
 		}
 	}
+
+	size_t hdr_len = sizeof(Elf32_Ehdr) + phnum * sizeof(Elf32_Phdr) +
+	                 sizeof(xtensa_core_note);
+	uint8_t *hdr = (uint8_t*)calloc(1, hdr_len);
+	Elf32_Ehdr *ehdr = (Elf32_Ehdr *)hdr;
+	Elf32_Phdr *phdr = (Elf32_Phdr *)(ehdr + 1);
+	xtensa_core_note *note = (xtensa_core_note *)(phdr + phnum);
+
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS32;
+	ehdr->e_ident[EI_DATA] = ELFDATA2LSB;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_type = ET_CORE;
+	ehdr->e_machine = EM_XTENSA;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_phoff = sizeof(Elf32_Ehdr);
+	ehdr->e_ehsize = sizeof(Elf32_Ehdr);
+	ehdr->e_phentsize = sizeof(Elf32_Phdr);
+	ehdr->e_phnum = phnum;
+
+	note->nhdr.n_namesz = 5;
+	note->nhdr.n_descsz = sizeof(xtensa_prstatus);
+	note->nhdr.n_type = NT_PRSTATUS;
+	strcpy(note->name, "CORE");
+	note->prstatus.si_signo = 5; // SIGTRAP
+	note->prstatus.cursig = 5;
+	note->prstatus.reg.pc = dbg_state.regs.pc;
+	note->prstatus.reg.ps = dbg_state.regs.ps;
+	note->prstatus.reg.sar = dbg_state.regs.sar;
+	note->prstatus.reg.windowstart = 1;
+	for (int i=0; i<16; i++) {
+		note->prstatus.reg.ar[i] = dbg_state.regs.a[i];
+	}
+
+	phdr[0].p_type = PT_NOTE;
+	phdr[0].p_offset = (uint8_t *)note - hdr;
+	phdr[0].p_filesz = sizeof(xtensa_core_note);
+	phdr[0].p_align = 4;
+
+	uint32_t offset = hdr_len;
+	int n = 1;
+	for (mem = dbg_state.memory; mem; mem = mem->next) {
+		if (dbg_mem_shadowed(mem)) {
+			continue;
+		}
+		phdr[n].p_type = PT_LOAD;
+		phdr[n].p_offset = offset;
+		phdr[n].p_vaddr = mem->base;
+		phdr[n].p_paddr = mem->base;
+		phdr[n].p_filesz = mem->size;
+		phdr[n].p_memsz = mem->size;
+		phdr[n].p_flags = mem->flags;
+		phdr[n].p_align = 1;
+		offset += mem->size;
+		n++;
+	}
+
+	int fd = open(fname, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		free(hdr);
+		return -1;
+	}
+	int ret = write_all(fd, hdr, hdr_len);
+	for (mem = dbg_state.memory; mem && !ret; mem = mem->next) {
+		if (!dbg_mem_shadowed(mem)) {
+			ret = write_region(fd, mem);
+		}
+	}
+	free(hdr);
+	if (close(fd) || ret) {
+		return -1;
+	}
+	return 0;
+}
+
+/*
+ * Set by SIGUSR1.  The signal interrupts a blocked read, so statistics are
+ * printed promptly even while the stub is waiting for the debugger.
+ */
+static volatile sig_atomic_t dbg_stats_requested;
+
+static void dbg_sys_sigusr1(int sig)
+{
+	dbg_stats_requested = 1;
+}
+
+static void dbg_sys_check_stats(void)
+{
+	if (dbg_stats_requested) {
+		dbg_stats_requested = 0;
+		dbg_stats_dump();
+	}
+}
+
+/*
+ * Wait for a debugger to connect to port, then make the connection the
+ * debugging stream in place of stdin and stdout.  Port 0 picks a free port;
+ * the one listened on is printed to stderr either way.
+ *
+ * Returns 0 on success, -1 on error.
+ */
+static int dbg_sys_listen(int port)
+{
+	struct sockaddr_in addr;
+	socklen_t addr_len = sizeof(addr);
+	int one = 1;
+	int lfd, fd;
+
+	lfd = socket(AF_INET, SOCK_STREAM, 0);
+	if (lfd < 0) {
+		return -1;
+	}
+	setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(port);
+	if (bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) ||
+	    listen(lfd, 1) ||
+	    getsockname(lfd, (struct sockaddr *)&addr, &addr_len)) {
+		close(lfd);
+		return -1;
+	}
+	fprintf(stderr, "Listening on port %d\n", ntohs(addr.sin_port));
+
+	fd = accept(lfd, NULL, NULL);
+	close(lfd);
+	if (fd < 0) {
+		return -1;
+	}
+	/* Replies are written whole, so there is nothing to gain from Nagle */
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	if ((dup2(fd, 0) < 0) || (dup2(fd, 1) < 0)) {
+		close(fd);
+		return -1;
+	}
 	close(fd);
+	return 0;
+}
+
+/*
+ * Bytes read from the debugging stream but not yet consumed.  Input is read
+ * a block at a time, into dbg_uring.in with io_uring and dbg_stdin_buf
+ * otherwise, so the packet parser can take everything that has arrived in
+ * one call.
+ */
+#define DBG_STDIN_BUF 0x4000
+
+static struct dbg_input {
+	const char *buf;
+	size_t      pos;
+	size_t      len;
+} dbg_in;
+
+static char dbg_stdin_buf[DBG_STDIN_BUF];
+
+#ifdef DBG_IO_URING
+/*
+ * With --io-uring the debugging stream bypasses stdio.  Output collects in
+ * a registered buffer until the stub next needs input, then goes out as a
+ * write linked to the read of the debugger's next bytes, so a request and
+ * its reply cost one io_uring_enter instead of a write and a read.
+ */
+#define DBG_URING_BUF 0x4000
+
+static struct dbg_uring {
+	int                  fd;  /* Ring, or -1 when stdio is in use */
+	unsigned            *sq_tail;
+	unsigned            *sq_mask;
+	unsigned            *sq_array;
+	struct io_uring_sqe *sqes;
+	unsigned            *cq_head;
+	unsigned            *cq_tail;
+	unsigned            *cq_mask;
+	struct io_uring_cqe *cqes;
+	size_t               out_len;
+	char                 in[DBG_URING_BUF];
+	char                 out[DBG_URING_BUF];
+} dbg_uring = { .fd = -1 };
+
+/*
+ * Create the ring, with the input and output buffers registered as fixed
+ * buffers and stdin and stdout as fixed files.
+ *
+ * Returns 0 on success, -1 if io_uring is unavailable.
+ */
+static int dbg_uring_setup(void)
+{
+	struct dbg_uring *u = &dbg_uring;
+	struct io_uring_params p;
+	struct iovec iov[2];
+	int files[2] = { 0, 1 };
+	size_t sq_len, cq_len;
+	uint8_t *sq, *cq;
+	void *sqes;
+	int fd;
+
+	memset(&p, 0, sizeof(p));
+	fd = syscall(__NR_io_uring_setup, 4, &p);
+	if (fd < 0) {
+		return -1;
+	}
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		sq_len = cq_len = (sq_len > cq_len) ? sq_len : cq_len;
+	}
+	sq = (uint8_t*)mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+	cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq :
+	     (uint8_t*)mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+	                    MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+	sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+	            PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+	            IORING_OFF_SQES);
+	iov[0].iov_base = u->in;
+	iov[0].iov_len = sizeof(u->in);
+	iov[1].iov_base = u->out;
+	iov[1].iov_len = sizeof(u->out);
+	if ((sq == MAP_FAILED) || (cq == MAP_FAILED) || (sqes == MAP_FAILED) ||
+	    syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, 2) ||
+	    syscall(__NR_io_uring_register, fd, IORING_REGISTER_FILES, files, 2)) {
+		close(fd);
+		return -1;
+	}
+
+	u->sq_tail = (unsigned*)(sq + p.sq_off.tail);
+	u->sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+	u->sq_array = (unsigned*)(sq + p.sq_off.array);
+	u->sqes = (struct io_uring_sqe*)sqes;
+	u->cq_head = (unsigned*)(cq + p.cq_off.head);
+	u->cq_tail = (unsigned*)(cq + p.cq_off.tail);
+	u->cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+	u->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+	u->fd = fd;
+	return 0;
+}
+
+/*
+ * Queue a read or write of len bytes between fixed file and fixed buffer buf.
+ */
+static void dbg_uring_queue(int op, int file, int buf, size_t len, int flags)
+{
+	struct dbg_uring *u = &dbg_uring;
+	unsigned tail = *u->sq_tail;
+	unsigned idx = tail & *u->sq_mask;
+	struct io_uring_sqe *sqe = &u->sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = op;
+	sqe->flags = IOSQE_FIXED_FILE | flags;
+	sqe->fd = file;
+	sqe->off = (uint64_t)-1;
+	sqe->addr = (uintptr_t)(buf ? u->out : u->in);
+	sqe->len = len;
+	sqe->buf_index = buf;
+	sqe->user_data = op;
+	u->sq_array[idx] = idx;
+	__atomic_store_n(u->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Send any pending output and, if read is set, refill the input buffer with
+ * whatever the debugger sends next, in a single submission.
+ *
+ * Returns 0 on success, EOF on error or when the debugger has gone away.
+ */
+static int dbg_uring_io(int read)
+{
+	struct dbg_uring *u = &dbg_uring;
+	unsigned to_submit = 0, pending;
+	int written = 0, got = 0;
+
+	if (u->out_len) {
+		/* A short write fails the link, cancelling the read */
+		dbg_uring_queue(IORING_OP_WRITE_FIXED, 1, 1, u->out_len,
+		                read ? IOSQE_IO_LINK : 0);
+		to_submit++;
+	}
+	if (read) {
+		dbg_uring_queue(IORING_OP_READ_FIXED, 0, 0, sizeof(u->in), 0);
+		to_submit++;
+	}
+
+	for (pending = to_submit; pending; ) {
+		unsigned head = *u->cq_head;
+		struct io_uring_cqe *cqe;
+
+		if (head == __atomic_load_n(u->cq_tail, __ATOMIC_ACQUIRE)) {
+			int ret = syscall(__NR_io_uring_enter, u->fd, to_submit, 1,
+			                  IORING_ENTER_GETEVENTS, NULL, 0);
+			if (ret > 0) {
+				to_submit -= ret;
+			} else if ((ret < 0) && (errno != EINTR)) {
+				return EOF;
+			}
+			dbg_sys_check_stats();
+			continue;
+		}
+		cqe = &u->cqes[head & *u->cq_mask];
+		if (cqe->user_data == IORING_OP_WRITE_FIXED) {
+			written = cqe->res;
+		} else {
+			got = cqe->res;
+		}
+		__atomic_store_n(u->cq_head, head + 1, __ATOMIC_RELEASE);
+		pending--;
+	}
+
+	if (u->out_len) {
+		if (written <= 0) {
+			return EOF;
+		}
+		u->out_len -= written;
+		if (u->out_len) {
+			memmove(u->out, &u->out[written], u->out_len);
+			return dbg_uring_io(read);
+		}
+	}
+	if (read) {
+		if (got <= 0) {
+			return EOF;
+		}
+		dbg_in.buf = u->in;
+		dbg_in.pos = 0;
+		dbg_in.len = got;
+	}
+	return 0;
 }
 
+static void dbg_uring_flush(void)
+{
+	if (dbg_uring.out_len) {
+		dbg_uring_io(0);
+	}
+}
+#endif
+
 /*
  * Write one character to the debugging stream.
  */
 int dbg_sys_putchar(int ch)
 {
-	int ret = putchar(ch);
+	char c = ch;
+	int ret;
+
+#ifdef DBG_IO_URING
+	if (dbg_uring.fd >= 0) {
+		return (dbg_sys_write(&c, 1) == EOF) ? EOF : (ch & 0xff);
+	}
+#endif
+	ret = putchar(c);
 	fflush(stdout);
 	return ret;
 }
 
+/*
+ * Write a whole buffer to the debugging stream, flushing once.
+ */
+int dbg_sys_write(const char *buf, size_t len)
+{
+#ifdef DBG_IO_URING
+	if (dbg_uring.fd >= 0) {
+		while (len) {
+			size_t n = sizeof(dbg_uring.out) - dbg_uring.out_len;
+			if (!n) {
+				if (dbg_uring_io(0) == EOF) {
+					return EOF;
+				}
+				continue;
+			}
+			n = (len < n) ? len : n;
+			memcpy(&dbg_uring.out[dbg_uring.out_len], buf, n);
+			dbg_uring.out_len += n;
+			buf += n;
+			len -= n;
+		}
+		return 0;
+	}
+#endif
+	if (fwrite(buf, 1, len, stdout) != len) {
+		return EOF;
+	}
+	return fflush(stdout);
+}
+
+/*
+ * Get the bytes buffered from the debugging stream, reading the next block
+ * first if they have all been consumed.  They stay buffered until passed
+ * to dbg_sys_consume.
+ *
+ * Returns the number of bytes at *buf, or EOF when the debugger has gone
+ * away.
+ */
+int dbg_sys_peek(const char **buf)
+{
+	ssize_t got;
+
+	while (dbg_in.pos == dbg_in.len) {
+		dbg_sys_check_stats();
+#ifdef DBG_IO_URING
+		if (dbg_uring.fd >= 0) {
+			if (dbg_uring_io(1) == EOF) {
+				return EOF;
+			}
+			continue;
+		}
+#endif
+		got = read(fileno(stdin), dbg_stdin_buf, sizeof(dbg_stdin_buf));
+		if (got > 0) {
+			dbg_in.buf = dbg_stdin_buf;
+			dbg_in.pos = 0;
+			dbg_in.len = got;
+		} else if ((got == 0) || (errno != EINTR)) {
+			return EOF;
+		}
+	}
+	*buf = &dbg_in.buf[dbg_in.pos];
+	return dbg_in.len - dbg_in.pos;
+}
+
+/*
+ * Drop len bytes returned by dbg_sys_peek from the buffer.
+ */
+void dbg_sys_consume(size_t len)
+{
+	dbg_in.pos += len;
+}
+
 /*
  * Read one character from the debugging stream.
  */
 int dbg_sys_getc(void)
 {
-	int ret = getchar() & 0xff;
-	return ret;
+	const char *buf;
+
+	if (dbg_sys_peek(&buf) == EOF) {
+		return EOF;
+	}
+	dbg_sys_consume(1);
+	return buf[0] & 0xff;
 }
 
 mem_region *dbg_find_mem(address addr)
@@ -130,6 +1523,35 @@ mem_region *dbg_find_mem(address addr)
 	return mem;
 }
 
+/*
+ * Get the page holding addr, for callers that cache page pointers.  Only
+ * succeeds if every byte of the page resolves to the same region, and for
+ * writes only if that region is writable, in which case the page is made
+ * private first.
+ */
+uint8_t *dbg_sys_mem_page(address addr, int write)
+{
+	address start = addr & ~DBG_PAGE_MASK;
+	mem_region *mem = dbg_find_mem(addr);
+	mem_region *here;
+
+	if (!mem || (start < mem->base) ||
+	    (start + DBG_PAGE_SIZE - 1 > mem->base + mem->size - 1) ||
+	    (write && !(mem->flags & PF_W))) {
+		return NULL;
+	}
+	for (here = dbg_state.memory; here != mem; here = here->next) {
+		if ((here->base <= start + DBG_PAGE_SIZE - 1) &&
+		    (start <= here->base + here->size - 1)) {
+			return NULL;
+		}
+	}
+	if (write) {
+		return dbg_mem_page_rw(mem, addr);
+	}
+	return dbg_mem_page(mem, DBG_PAGE_INDEX(mem, addr));
+}
+
 /*
  * Read one byte from memory.
  */
@@ -139,7 +1561,7 @@ int dbg_sys_mem_readb(address addr, char *val)
 	if (!mem) {
 		return -1;
 	}
-	*val = mem->data[addr - mem->base];
+	*val = dbg_mem_page(mem, DBG_PAGE_INDEX(mem, addr))[addr & DBG_PAGE_MASK];
 	return 0;
 }
 
@@ -152,24 +1574,170 @@ int dbg_sys_mem_writeb(address addr, char val)
 	if (!mem) {
 		return -1;
 	}
-	mem->data[addr - mem->base] = val;
+	dbg_mem_page_rw(mem, addr)[addr & DBG_PAGE_MASK] = val;
+	xt_invalidate(&dbg_state, addr);
 	return 0;
 }
 
+/*
+ * Note that len bytes at addr were written through pages from
+ * dbg_sys_mem_page, so the emulator drops what it has cached of them.
+ */
+void dbg_sys_mem_dirty(address addr, size_t len)
+{
+	address page, last;
+
+	if (!len) {
+		return;
+	}
+	last = (addr + len - 1) & ~DBG_PAGE_MASK;
+	for (page = addr & ~DBG_PAGE_MASK; ; page += DBG_PAGE_SIZE) {
+		xt_invalidate(&dbg_state, page);
+		if (page == last) {
+			break;
+		}
+	}
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return (x > y) - (x < y);
+}
+
+/*
+ * Describe the visible memory as a gdb memory map, in which regions that
+ * aren't writable are rom so gdb may cache them.  Overlapping regions are
+ * split at their edges and each piece attributed to the region dbg_find_mem
+ * would pick.  Built once, as regions don't change after loading.
+ *
+ * Returns the XML document, or NULL if there is no memory.
+ */
+const char *dbg_sys_memory_map(void)
+{
+	char *xml;
+	size_t xml_len, n = 0;
+	uint64_t *edges, start = 0, end = 0;
+	const char *type = NULL;
+	mem_region *mem;
+	FILE *f;
+
+	if (dbg_state.memory_map || !dbg_state.memory) {
+		return dbg_state.memory_map;
+	}
+
+	for (mem = dbg_state.memory; mem; mem = mem->next) {
+		n += 2;
+	}
+	edges = (uint64_t*)malloc(n * sizeof(uint64_t));
+	n = 0;
+	for (mem = dbg_state.memory; mem; mem = mem->next) {
+		edges[n++] = mem->base;
+		edges[n++] = (uint64_t)mem->base + mem->size;
+	}
+	qsort(edges, n, sizeof(uint64_t), cmp_u64);
+
+	f = open_memstream(&xml, &xml_len);
+	fprintf(f, "<?xml version=\"1.0\"?>\n"
+	           "<!DOCTYPE memory-map PUBLIC \"+//IDN gnu.org//DTD GDB Memory Map V1.0//EN\"\n"
+	           "    \"http://sourceware.org/gdb/gdb-memory-map.dtd\">\n"
+	           "<memory-map>\n");
+	for (size_t i=0; i+1<n; i++) {
+		if (edges[i] == edges[i+1]) {
+			continue;
+		}
+		mem = dbg_find_mem(edges[i]);
+		const char *here = !mem ? NULL : (mem->flags & PF_W) ? "ram" : "rom";
+		if (type && (here != type || edges[i] != end)) {
+			fprintf(f, "  <memory type=\"%s\" start=\"0x%llx\" length=\"0x%llx\"/>\n",
+			        type, (unsigned long long)start, (unsigned long long)(end - start));
+			type = NULL;
+		}
+		if (here) {
+			if (!type) {
+				type = here;
+				start = edges[i];
+			}
+			end = edges[i+1];
+		}
+	}
+	if (type) {
+		fprintf(f, "  <memory type=\"%s\" start=\"0x%llx\" length=\"0x%llx\"/>\n",
+		        type, (unsigned long long)start, (unsigned long long)(end - start));
+	}
+	fprintf(f, "</memory-map>\n");
+	fclose(f);
+	free(edges);
+	dbg_state.memory_map = (char*)dbg_arena_alloc(&dbg_state.arena, xml_len + 1);
+	memcpy(dbg_state.memory_map, xml, xml_len + 1);
+	free(xml);
+	return dbg_state.memory_map;
+}
+
+/*
+ * Check, without blocking, whether the debugger sent an interrupt (^C) while
+ * the target is running.  A closed stream also counts, so a run can't
+ * outlive its debugger.
+ */
+int dbg_sys_poll_interrupt(void)
+{
+	struct pollfd pfd = { .fd = fileno(stdin), .events = POLLIN };
+	const char *buf;
+
+	if (dbg_replaying()) {
+		return dbg_replay_interrupt();
+	}
+#ifdef DBG_IO_URING
+	/* The ack for the packet which set the target running */
+	dbg_uring_flush();
+#endif
+	if ((dbg_in.pos == dbg_in.len) && (poll(&pfd, 1, 0) != 1)) {
+		return 0;
+	}
+	if (dbg_sys_peek(&buf) == EOF) {
+		return 1;
+	}
+	if (buf[0] == 0x03) {
+		dbg_sys_consume(1);
+		return 1;
+	}
+	return 0;
+}
+
+/*
+ * Insert or remove a breakpoint of the given DBG_BP_* type.
+ */
+int dbg_sys_breakpoint(int type, address addr, int insert)
+{
+	return xt_breakpoint(&dbg_state, addr, type, insert);
+}
+
+/*
+ * Insert or remove a watchpoint of the given DBG_WP_* type over len bytes.
+ */
+int dbg_sys_watchpoint(int type, address addr, size_t len, int insert)
+{
+	return xt_watchpoint(&dbg_state, addr, len, type, insert);
+}
+
 /*
  * Continue program execution.
+ *
+ * Returns the signal the emulated target stopped with.
  */
 int dbg_sys_continue(void)
 {
-	return -1;
+	return xt_run(&dbg_state, 0);
 }
 
 /*
  * Single step the next instruction.
+ *
+ * Returns the signal the emulated target stopped with.
  */
 int dbg_sys_step(void)
 {
-	return -1;
+	return xt_run(&dbg_state, 1);
 }
 
 
@@ -177,19 +1745,59 @@ extern int dbg_main(struct dbg_state *state);
 
 void usage()
 {
-	fprintf(stderr, "USAGE: gdbstub-xtensa-core --log <logfile.txt> --elf </path/to/sketch.ino.elf>\n");
+	fprintf(stderr, "USAGE: gdbstub-xtensa-core --log <logfile.txt> --elf </path/to/sketch.ino.elf> [--write-core <out.core>] [--no-cache] [--no-rle] [--tdesc] [--record <session>] [--replay <session>] [--stats] [--timings[=json]] [--port <n>] [--io-uring] [--mem-budget <bytes>[K|M]]\n");
 	exit(1);
 }
 
 int main(int argc, char **argv)
 {
-	const char *elf;
-	const char *log;
+	const char *elf = NULL;
+	const char *log = NULL;
+	const char *core = NULL;
+	const char *record = NULL;
+	const char *replay = NULL;
+	int port = -1;
+	int uring = 0;
+	size_t budget = 0;
+	struct sigaction sa;
+	clock_gettime(CLOCK_MONOTONIC, &dbg_timing_base);
+	/* Registered first so it runs after every other exit handler */
+	atexit(dbg_state_destroy);
 	for (int i=1; i<argc; i++) {
 		if (!strcmp(argv[i], "--log")) {
 			log = argv[++i];
 		} else if (!strcmp(argv[i], "--elf")) {
 			elf = argv[++i];
+		} else if (!strcmp(argv[i], "--write-core")) {
+			core = argv[++i];
+		} else if (!strcmp(argv[i], "--no-cache")) {
+			dbg_use_cache = 0;
+		} else if (!strcmp(argv[i], "--no-rle")) {
+			dbg_use_rle = 0;
+		} else if (!strcmp(argv[i], "--tdesc")) {
+			dbg_use_tdesc = 1;
+		} else if (!strcmp(argv[i], "--record")) {
+			record = argv[++i];
+		} else if (!strcmp(argv[i], "--replay")) {
+			replay = argv[++i];
+		} else if (!strcmp(argv[i], "--stats")) {
+			atexit(dbg_stats_dump);
+		} else if (!strcmp(argv[i], "--timings")) {
+			dbg_timings = 1;
+		} else if (!strcmp(argv[i], "--timings=json")) {
+			dbg_timings = 2;
+		} else if (!strcmp(argv[i], "--port")) {
+			port = atoi(argv[++i]);
+		} else if (!strcmp(argv[i], "--io-uring")) {
+			uring = 1;
+		} else if (!strcmp(argv[i], "--mem-budget")) {
+			char *end;
+			budget = strtoul(argv[++i], &end, 0);
+			if ((*end | 0x20) == 'k') {
+				budget <<= 10;
+			} else if ((*end | 0x20) == 'm') {
+				budget <<= 20;
+			}
 		} else {
 			usage();
 		}
@@ -197,8 +1805,56 @@ int main(int argc, char **argv)
 	if (!elf || !log) {
 		usage();
 	}
+	if (dbg_timings) {
+		atexit(dbg_timings_report);
+	}
 	dbg_sys_load(log);
 	dbg_sys_load_elf(elf);
+	if (core) {
+		double start = dbg_timing_now();
+		if (dbg_sys_write_core(core)) {
+			perror(core);
+			return 1;
+		}
+		dbg_phase_end("write_core", start);
+		return 0;
+	}
+	if (budget) {
+		dbg_budget_start(budget);
+	}
+	if ((port >= 0) && dbg_sys_listen(port)) {
+		perror("--port");
+		return 1;
+	}
+	if (uring) {
+#ifdef DBG_IO_URING
+		if (dbg_uring_setup()) {
+			perror("io_uring unavailable, using stdio");
+		} else {
+			atexit(dbg_uring_flush);
+		}
+#else
+		fprintf(stderr, "io_uring not supported by this build, using stdio\n");
+#endif
+	}
+	/* No SA_RESTART, so a blocked read returns to dbg_sys_getc */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = dbg_sys_sigusr1;
+	sigaction(SIGUSR1, &sa, NULL);
+
+	if (record && dbg_record_start(record)) {
+		perror(record);
+		return 1;
+	}
+	dbg_phase_end("startup", 0);
+	if (replay) {
+		if (dbg_replay_start(replay)) {
+			perror(replay);
+			return 1;
+		}
+		dbg_main(&dbg_state);
+		return dbg_replay_finish();
+	}
 	dbg_main(&dbg_state);
 }
 
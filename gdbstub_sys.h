@@ -21,15 +21,47 @@
 
 typedef uint32_t address;
 typedef uint32_t reg;
-#define DBG_NUM_REGISTERS 113
+
+#define DBG_PAGE_SHIFT 12
+#define DBG_PAGE_SIZE  (1 << DBG_PAGE_SHIFT)
+#define DBG_PAGE_MASK  (DBG_PAGE_SIZE - 1)
+
+/*
+ * Region contents are held in pages of DBG_PAGE_SIZE bytes, aligned to target
+ * addresses, so the first and last page of a region may be partial.  Pages
+ * that are all zero or all RAM fill point at one shared read-only page and
+ * only get a private copy once they are written.
+ *
+ * Under a memory budget, private pages that were never written may be
+ * evicted, leaving NULL, and are read back from the region's source when
+ * next used.
+ */
+enum {
+	DBG_SRC_NONE,  /* Pages can't be read back */
+	DBG_SRC_FILE,  /* Raw bytes in src_fd, as in an ELF segment */
+	DBG_SRC_HEX,   /* Hex text in src_fd, as in a crash log */
+	DBG_SRC_MAP,   /* Raw bytes in the mapped sidecar at src_map */
+};
 
 typedef struct mem_region {
 	uint32_t           base;
 	uint32_t           size;
-	uint8_t           *data;
+	uint32_t           flags; /* PF_R/PF_W/PF_X, as in an ELF phdr */
+	uint8_t          **pages;
 	struct mem_region *next;
+	int                src;      /* DBG_SRC_* */
+	int                src_fd;
+	uint32_t           src_len;  /* Bytes from base the source covers */
+	const uint32_t    *src_offs; /* Per page, offset of its first byte */
+	uint8_t           *src_map;
+	struct mem_lru    *lru;      /* Per page, once a budget is set */
 } mem_region;
 
+#define DBG_NUM_PAGES(base, size) \
+	((((base) + (size) - 1) >> DBG_PAGE_SHIFT) - ((base) >> DBG_PAGE_SHIFT) + 1)
+#define DBG_PAGE_INDEX(mem, addr) \
+	(((addr) >> DBG_PAGE_SHIFT) - ((mem)->base >> DBG_PAGE_SHIFT))
+
 typedef struct registers {
 	uint32_t pc;
 	uint32_t ps;
@@ -42,11 +74,61 @@ typedef struct registers {
 	uint32_t valid;
 } registers;
 
+/* Why the target last stopped, when there is more to it than a signal */
+enum {
+	DBG_STOP_SIGNAL,
+	DBG_STOP_SWBREAK,
+	DBG_STOP_HWBREAK,
+	DBG_STOP_WATCH,
+	DBG_STOP_RWATCH,
+	DBG_STOP_AWATCH,
+};
+
+/*
+ * Everything a dump allocates comes from its arena, carved out of large
+ * blocks and released all at once by dbg_state_destroy.  Target pages are
+ * recycled through a free list, as eviction gives them back one at a time.
+ */
+typedef struct dbg_arena {
+	struct dbg_arena_block *blocks;
+	void                   *free_pages;
+	size_t                  bytes;  /* Taken from the system */
+} dbg_arena;
+
+struct xt_cpu;
+
 struct dbg_state {
 	registers regs;
 	mem_region *memory;
+	struct xt_cpu *cpu;  /* Emulator caches, created on first run */
+	int stop_reason;     /* DBG_STOP_* */
+	address stop_addr;   /* Data address of a watchpoint hit */
+	dbg_arena arena;
+	uint8_t *cache_map;  /* Mapped sidecar, if loaded from one */
+	size_t cache_len;
+	char *memory_map;    /* Built by dbg_sys_memory_map */
 };
 
 void dbg_sys_load(const char *fname);     /* Parse dump into dbg_state */
 void dbg_sys_load_elf(const char *fname); /* ELF binary being debugged */
+int dbg_sys_write_core(const char *fname); /* Export state as ELF core */
+void dbg_state_destroy(void);             /* Release the whole dump */
+
+/* Per-dump allocation */
+void *dbg_arena_alloc(dbg_arena *arena, size_t size);
+uint8_t *dbg_arena_page(dbg_arena *arena);
+void dbg_arena_free_page(dbg_arena *arena, uint8_t *page);
+
+/* Memory helpers shared with the emulator */
+mem_region *dbg_find_mem(address addr);
+uint8_t *dbg_mem_page_rw(mem_region *mem, address addr);
+uint8_t *dbg_sys_mem_page(address addr, int write);
+void dbg_sys_mem_dirty(address addr, size_t len);
+int dbg_sys_poll_interrupt(void);
+
+/* LX106 emulator (gdbstub_xtensa.c) */
+int xt_run(struct dbg_state *state, int step);
+void xt_invalidate(struct dbg_state *state, address addr);
+int xt_breakpoint(struct dbg_state *state, address addr, int type, int insert);
+int xt_watchpoint(struct dbg_state *state, address addr, size_t len, int type, int insert);
 
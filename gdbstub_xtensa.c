@@ -0,0 +1,1197 @@
+/*
+ * Copyright (C) 2016  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Instruction set emulator for the ESP8266's Xtensa LX106 core, running
+ * directly on the dump's registers and memory regions.
+ *
+ * Covers the configuration the LX106 was built with: the core ISA with the
+ * code density, MUL16, MUL32 (MULL only) and NSA options, and extended L32R.
+ * There are no register windows, zero-overhead loops, booleans or dividers.
+ * Exceptions are not vectored; the target simply stops with a signal, with PC
+ * left on the offending instruction.
+ */
+
+#include "gdbstub.h"
+#include <string.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <elf.h>
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+/* Decoded operations.  XT_OP_DECODE marks a slot that is not decoded yet. */
+enum {
+	XT_OP_DECODE = 0,
+	XT_OP_ILL, XT_OP_FETCH_FAULT, XT_OP_NOP,
+	XT_OP_BREAK, XT_OP_SYSCALL, XT_OP_WAITI, XT_OP_RSIL,
+	XT_OP_RSR, XT_OP_WSR, XT_OP_XSR,
+	XT_OP_ADD, XT_OP_ADDX2, XT_OP_ADDX4, XT_OP_ADDX8,
+	XT_OP_SUB, XT_OP_SUBX2, XT_OP_SUBX4, XT_OP_SUBX8,
+	XT_OP_AND, XT_OP_OR, XT_OP_XOR, XT_OP_NEG, XT_OP_ABS,
+	XT_OP_ADDI, XT_OP_MOVI,
+	XT_OP_MULL, XT_OP_MUL16U, XT_OP_MUL16S,
+	XT_OP_SLLI, XT_OP_SRAI, XT_OP_SRLI, XT_OP_EXTUI,
+	XT_OP_SRC, XT_OP_SRL, XT_OP_SLL, XT_OP_SRA,
+	XT_OP_SSR, XT_OP_SSL, XT_OP_SSA8L, XT_OP_SSA8B, XT_OP_SSAI,
+	XT_OP_NSA, XT_OP_NSAU,
+	XT_OP_MOVEQZ, XT_OP_MOVNEZ, XT_OP_MOVLTZ, XT_OP_MOVGEZ,
+	XT_OP_L8UI, XT_OP_L16UI, XT_OP_L16SI, XT_OP_L32I, XT_OP_L32R,
+	XT_OP_S8I, XT_OP_S16I, XT_OP_S32I,
+	XT_OP_J, XT_OP_JX, XT_OP_CALL0, XT_OP_CALLX0,
+	XT_OP_BEQZ, XT_OP_BNEZ, XT_OP_BLTZ, XT_OP_BGEZ,
+	XT_OP_BEQI, XT_OP_BNEI, XT_OP_BLTI, XT_OP_BGEI,
+	XT_OP_BLTUI, XT_OP_BGEUI,
+	XT_OP_BNONE, XT_OP_BEQ, XT_OP_BLT, XT_OP_BLTU, XT_OP_BALL, XT_OP_BBC,
+	XT_OP_BANY, XT_OP_BNE, XT_OP_BGE, XT_OP_BGEU, XT_OP_BNALL, XT_OP_BBS,
+	XT_OP_BBCI, XT_OP_BBSI,
+};
+
+/*
+ * A predecoded instruction.  Register fields are normalized so d is always
+ * the destination and a/b the sources, whatever the encoding.  Branch and
+ * call targets and L32R literal addresses are resolved at decode time.
+ */
+typedef struct xt_insn {
+	uint8_t  op;
+	uint8_t  len;
+	uint8_t  d;
+	uint8_t  a;
+	uint8_t  b;
+	uint8_t  sh;      /* shift amount or bit number */
+	uint8_t  bp;      /* DBG_BP_* types of breakpoints set here */
+	uint8_t  pad;
+	uint32_t imm;
+	uint32_t target;
+} xt_insn;
+
+#define XT_NO_PAGE       0xffffffff
+#define XT_ICACHE_PAGES  64
+#define XT_TLB_SIZE      256
+#define XT_POLL_INTERVAL (1 << 20)
+#define XT_NUM_VPAGES    (1u << (32 - DBG_PAGE_SHIFT))
+
+/* Returned by xt_load/xt_store when the access was made but hit a watchpoint */
+#define XT_WATCH         (-1)
+
+/* Decoded instructions for one target page, one slot per byte offset */
+typedef struct xt_icache_page {
+	uint32_t vpage;
+	xt_insn  insn[DBG_PAGE_SIZE];
+} xt_icache_page;
+
+/*
+ * Breakpoint addresses, in an open-addressed hash set with linear probing.
+ * Decoding copies an address's entry into xt_insn.bp, so the run loop never
+ * consults the set itself.
+ */
+typedef struct xt_bp {
+	uint32_t addr;
+	uint8_t  type;    /* DBG_BP_* bits, 0 for an empty slot */
+} xt_bp;
+
+typedef struct xt_bpset {
+	xt_bp   *slots;
+	uint32_t size;    /* power of two */
+	uint32_t used;
+} xt_bpset;
+
+/*
+ * Watchpoints, in a plain list as there are only ever a few.  Pages any of
+ * them touch are marked in a bitmap and kept out of the TLBs, so the fast
+ * path never has to look at the list.
+ */
+typedef struct xt_wp {
+	uint32_t addr;
+	uint32_t len;
+	uint8_t  type;    /* DBG_WP_* */
+} xt_wp;
+
+typedef struct xt_wpset {
+	xt_wp   *wps;
+	uint32_t used;
+	uint32_t size;
+	uint8_t *pages;   /* One bit per target page, allocated on first use */
+	int      hit;     /* DBG_STOP_* of the last hit */
+	uint32_t hit_addr;
+} xt_wpset;
+
+typedef struct xt_tlb {
+	uint32_t vpage[XT_TLB_SIZE];
+	uint8_t *page[XT_TLB_SIZE];
+} xt_tlb;
+
+struct xt_cpu {
+	xt_icache_page *icache[XT_ICACHE_PAGES];
+	xt_tlb          rtlb;
+	xt_tlb          wtlb;
+	xt_bpset        bps;
+	xt_wpset        wps;
+	uint32_t        litbase;  /* LITBASE the icache was decoded with */
+	uint32_t        sr[256];  /* Special registers not kept in registers */
+	dbg_arena      *arena;    /* The dump's, which everything here comes from */
+};
+
+/*****************************************************************************
+ * Const Data
+ ****************************************************************************/
+
+static const uint32_t b4const[16] = {
+	-1, 1, 2, 3, 4, 5, 6, 7, 8, 10, 12, 16, 32, 64, 128, 256
+};
+
+static const uint32_t b4constu[16] = {
+	32768, 65536, 2, 3, 4, 5, 6, 7, 8, 10, 12, 16, 32, 64, 128, 256
+};
+
+/*****************************************************************************
+ * Caches
+ ****************************************************************************/
+
+static void xt_tlb_flush(xt_tlb *tlb)
+{
+	for (int i=0; i<XT_TLB_SIZE; i++) {
+		tlb->vpage[i] = XT_NO_PAGE;
+	}
+}
+
+static void xt_tlb_drop(xt_tlb *tlb, uint32_t vpage)
+{
+	if (tlb->vpage[vpage & (XT_TLB_SIZE-1)] == vpage) {
+		tlb->vpage[vpage & (XT_TLB_SIZE-1)] = XT_NO_PAGE;
+	}
+}
+
+static int xt_icache_has(struct xt_cpu *cpu, uint32_t vpage)
+{
+	xt_icache_page *page = cpu->icache[vpage & (XT_ICACHE_PAGES-1)];
+	return page && (page->vpage == vpage);
+}
+
+static void xt_icache_drop(struct xt_cpu *cpu, uint32_t vpage)
+{
+	if (xt_icache_has(cpu, vpage)) {
+		cpu->icache[vpage & (XT_ICACHE_PAGES-1)]->vpage = XT_NO_PAGE;
+	}
+}
+
+static void xt_icache_flush(struct xt_cpu *cpu)
+{
+	for (int i=0; i<XT_ICACHE_PAGES; i++) {
+		if (cpu->icache[i]) {
+			cpu->icache[i]->vpage = XT_NO_PAGE;
+		}
+	}
+}
+
+/*
+ * Get the decoded page for pc, recycling its slot if needed.  Instructions
+ * may run into the following page, so stores to vpage or vpage+1 must take
+ * the slow path that invalidates this page; drop their fast write entries.
+ */
+static xt_icache_page *xt_icache_get(struct xt_cpu *cpu, uint32_t pc)
+{
+	uint32_t vpage = pc >> DBG_PAGE_SHIFT;
+	xt_icache_page **slot = &cpu->icache[vpage & (XT_ICACHE_PAGES-1)];
+
+	if (!*slot) {
+		*slot = (xt_icache_page*)dbg_arena_alloc(cpu->arena, sizeof(xt_icache_page));
+		(*slot)->vpage = XT_NO_PAGE;
+	}
+	if ((*slot)->vpage != vpage) {
+		memset((*slot)->insn, 0, sizeof((*slot)->insn));
+		(*slot)->vpage = vpage;
+		xt_tlb_drop(&cpu->wtlb, vpage);
+		xt_tlb_drop(&cpu->wtlb, vpage + 1);
+	}
+	return *slot;
+}
+
+/*
+ * Forget everything cached about the page holding addr.  Called for every
+ * memory write made outside the emulator's fast store path.
+ */
+void xt_invalidate(struct dbg_state *state, address addr)
+{
+	struct xt_cpu *cpu = state->cpu;
+	uint32_t vpage = addr >> DBG_PAGE_SHIFT;
+
+	if (!cpu) {
+		return;
+	}
+	xt_tlb_drop(&cpu->rtlb, vpage);
+	xt_tlb_drop(&cpu->wtlb, vpage);
+	xt_icache_drop(cpu, vpage);
+	xt_icache_drop(cpu, vpage - 1);
+}
+
+static struct xt_cpu *xt_cpu_get(struct dbg_state *state)
+{
+	if (!state->cpu) {
+		state->cpu = (struct xt_cpu*)dbg_arena_alloc(&state->arena, sizeof(struct xt_cpu));
+		state->cpu->arena = &state->arena;
+		xt_tlb_flush(&state->cpu->rtlb);
+		xt_tlb_flush(&state->cpu->wtlb);
+		state->cpu->litbase = state->regs.litbase;
+	}
+	return state->cpu;
+}
+
+/*****************************************************************************
+ * Breakpoints
+ ****************************************************************************/
+
+static inline uint32_t xt_bp_hash(xt_bpset *set, uint32_t addr)
+{
+	uint32_t hash = addr * 0x9e3779b1u;
+	return (hash ^ (hash >> 16)) & (set->size - 1);
+}
+
+static xt_bp *xt_bp_find(xt_bpset *set, uint32_t addr)
+{
+	if (!set->used) {
+		return NULL;
+	}
+	for (uint32_t i = xt_bp_hash(set, addr); set->slots[i].type; i = (i + 1) & (set->size - 1)) {
+		if (set->slots[i].addr == addr) {
+			return &set->slots[i];
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Double the table.  The old one stays in the arena, never bigger than half
+ * the new one.
+ */
+static void xt_bp_grow(xt_bpset *set, dbg_arena *arena)
+{
+	xt_bpset old = *set;
+
+	set->size = old.size ? old.size * 2 : 64;
+	set->slots = (xt_bp*)dbg_arena_alloc(arena, set->size * sizeof(xt_bp));
+	for (uint32_t n=0; n<old.size; n++) {
+		if (old.slots[n].type) {
+			uint32_t i = xt_bp_hash(set, old.slots[n].addr);
+			while (set->slots[i].type) {
+				i = (i + 1) & (set->size - 1);
+			}
+			set->slots[i] = old.slots[n];
+		}
+	}
+}
+
+/*
+ * Remove a slot, shifting back any later entries of its probe run so that
+ * lookups never need tombstones.
+ */
+static void xt_bp_erase(xt_bpset *set, xt_bp *bp)
+{
+	uint32_t hole = bp - set->slots;
+	uint32_t i = hole;
+
+	while (1) {
+		i = (i + 1) & (set->size - 1);
+		if (!set->slots[i].type) {
+			break;
+		}
+		uint32_t home = xt_bp_hash(set, set->slots[i].addr);
+		if (((i - home) & (set->size - 1)) >= ((i - hole) & (set->size - 1))) {
+			set->slots[hole] = set->slots[i];
+			hole = i;
+		}
+	}
+	set->slots[hole].type = 0;
+	set->used--;
+}
+
+/*
+ * Insert or remove a breakpoint of the given DBG_BP_* type.
+ */
+int xt_breakpoint(struct dbg_state *state, address addr, int type, int insert)
+{
+	struct xt_cpu *cpu = xt_cpu_get(state);
+	xt_bpset *set = &cpu->bps;
+	xt_bp *bp = xt_bp_find(set, addr);
+	uint8_t types;
+
+	if (insert) {
+		if (!bp) {
+			if ((set->used + 1) * 2 > set->size) {
+				xt_bp_grow(set, cpu->arena);
+			}
+			uint32_t i = xt_bp_hash(set, addr);
+			while (set->slots[i].type) {
+				i = (i + 1) & (set->size - 1);
+			}
+			bp = &set->slots[i];
+			bp->addr = addr;
+			bp->type = 0;
+			set->used++;
+		}
+		bp->type |= type;
+		types = bp->type;
+	} else {
+		if (!bp) {
+			return 0;
+		}
+		bp->type &= ~type;
+		types = bp->type;
+		if (!types) {
+			xt_bp_erase(set, bp);
+		}
+	}
+
+	// Keep an already decoded instruction in step with the set
+	if (xt_icache_has(cpu, addr >> DBG_PAGE_SHIFT)) {
+		cpu->icache[(addr >> DBG_PAGE_SHIFT) & (XT_ICACHE_PAGES-1)]->insn[addr & DBG_PAGE_MASK].bp = types;
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Watchpoints
+ ****************************************************************************/
+
+static inline int xt_page_watched(struct xt_cpu *cpu, uint32_t vpage)
+{
+	return cpu->wps.used && ((cpu->wps.pages[vpage >> 3] >> (vpage & 7)) & 1);
+}
+
+static void xt_wp_mark(struct xt_cpu *cpu, xt_wp *wp)
+{
+	uint32_t first = wp->addr >> DBG_PAGE_SHIFT;
+	uint32_t last = (wp->addr + wp->len - 1) >> DBG_PAGE_SHIFT;
+
+	for (uint32_t vpage = first; ; vpage++) {
+		cpu->wps.pages[vpage >> 3] |= 1 << (vpage & 7);
+		xt_tlb_drop(&cpu->rtlb, vpage);
+		xt_tlb_drop(&cpu->wtlb, vpage);
+		if (vpage == last) {
+			break;
+		}
+	}
+}
+
+/*
+ * Check an access to a watched page against the watchpoints.
+ *
+ * Returns XT_WATCH, with the hit recorded, or 0.
+ */
+static int xt_wp_check(struct xt_cpu *cpu, uint32_t addr, int size, int type)
+{
+	for (uint32_t i=0; i<cpu->wps.used; i++) {
+		xt_wp *wp = &cpu->wps.wps[i];
+		if (!(wp->type & type) ||
+		    (addr - wp->addr >= wp->len && wp->addr - addr >= (uint32_t)size)) {
+			continue;
+		}
+		switch (wp->type) {
+		case DBG_WP_WRITE: cpu->wps.hit = DBG_STOP_WATCH; break;
+		case DBG_WP_READ:  cpu->wps.hit = DBG_STOP_RWATCH; break;
+		default:           cpu->wps.hit = DBG_STOP_AWATCH; break;
+		}
+		cpu->wps.hit_addr = (addr - wp->addr < wp->len) ? addr : wp->addr;
+		return XT_WATCH;
+	}
+	return 0;
+}
+
+/*
+ * Insert or remove a watchpoint of the given DBG_WP_* type.
+ */
+int xt_watchpoint(struct dbg_state *state, address addr, size_t len, int type, int insert)
+{
+	struct xt_cpu *cpu = xt_cpu_get(state);
+	xt_wpset *set = &cpu->wps;
+	uint32_t i;
+
+	if (len == 0 || len - 1 > (uint32_t)~addr || len > UINT32_MAX) {
+		return EOF;
+	}
+	for (i=0; i<set->used; i++) {
+		if (set->wps[i].addr == addr && set->wps[i].len == len &&
+		    set->wps[i].type == type) {
+			break;
+		}
+	}
+
+	if (insert) {
+		if (i < set->used) {
+			return 0;
+		}
+		if (!set->pages) {
+			set->pages = (uint8_t*)dbg_arena_alloc(cpu->arena, XT_NUM_VPAGES / 8);
+		}
+		if (set->used == set->size) {
+			xt_wp *wps = set->wps;
+			set->size = set->size ? set->size * 2 : 8;
+			set->wps = (xt_wp*)dbg_arena_alloc(cpu->arena, set->size * sizeof(xt_wp));
+			if (set->used) {
+				memcpy(set->wps, wps, set->used * sizeof(xt_wp));
+			}
+		}
+		xt_wp *wp = &set->wps[set->used++];
+		wp->addr = addr;
+		wp->len = len;
+		wp->type = type;
+		xt_wp_mark(cpu, wp);
+		return 0;
+	}
+
+	if (i == set->used) {
+		return 0;
+	}
+	set->wps[i] = set->wps[--set->used];
+
+	// Pages may be shared with other watchpoints, so rebuild the bitmap
+	memset(set->pages, 0, XT_NUM_VPAGES / 8);
+	for (i=0; i<set->used; i++) {
+		xt_wp_mark(cpu, &set->wps[i]);
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Memory Access
+ ****************************************************************************/
+
+/*
+ * Look addr up in a TLB, filling the entry on a miss.  Returns NULL when the
+ * page can't be accessed directly and the caller must go byte by byte.
+ */
+static inline uint8_t *xt_tlb_page(struct xt_cpu *cpu, xt_tlb *tlb, uint32_t addr, int write)
+{
+	uint32_t vpage = addr >> DBG_PAGE_SHIFT;
+	uint32_t slot = vpage & (XT_TLB_SIZE-1);
+
+	if (tlb->vpage[slot] == vpage) {
+		return tlb->page[slot];
+	}
+	if (xt_page_watched(cpu, vpage)) {
+		return NULL;
+	}
+	if (write && (xt_icache_has(cpu, vpage) || xt_icache_has(cpu, vpage - 1))) {
+		return NULL;
+	}
+	uint8_t *page = dbg_sys_mem_page(addr, write);
+	if (!page) {
+		return NULL;
+	}
+	if (write) {
+		// The page may just have been made private
+		xt_tlb_drop(&cpu->rtlb, vpage);
+	}
+	tlb->vpage[slot] = vpage;
+	tlb->page[slot] = page;
+	return page;
+}
+
+/*
+ * Load a little-endian value of size bytes.
+ *
+ * Returns 0, XT_WATCH or the signal to stop with.
+ */
+static inline int xt_load(struct xt_cpu *cpu, uint32_t addr, int size, uint32_t *val)
+{
+	const uint8_t *src;
+	uint8_t buf[4];
+
+	if (addr & (size - 1)) {
+		return DBG_SIGBUS;
+	}
+	uint8_t *page = xt_tlb_page(cpu, &cpu->rtlb, addr, 0);
+	if (page) {
+		src = page + (addr & DBG_PAGE_MASK);
+	} else {
+		for (int i=0; i<size; i++) {
+			if (dbg_sys_mem_readb(addr + i, (char *)&buf[i])) {
+				return DBG_SIGSEGV;
+			}
+		}
+		src = buf;
+	}
+	switch (size) {
+	case 1:  *val = src[0]; break;
+	case 2:  *val = src[0] | (src[1] << 8); break;
+	default: *val = src[0] | (src[1] << 8) | (src[2] << 16) | ((uint32_t)src[3] << 24); break;
+	}
+	if (!page && xt_page_watched(cpu, addr >> DBG_PAGE_SHIFT)) {
+		return xt_wp_check(cpu, addr, size, DBG_WP_READ);
+	}
+	return 0;
+}
+
+/*
+ * Store a little-endian value of size bytes.
+ *
+ * Returns 0, XT_WATCH or the signal to stop with.
+ */
+static inline int xt_store(struct xt_cpu *cpu, uint32_t addr, int size, uint32_t val)
+{
+	if (addr & (size - 1)) {
+		return DBG_SIGBUS;
+	}
+	uint8_t *page = xt_tlb_page(cpu, &cpu->wtlb, addr, 1);
+	if (page) {
+		uint8_t *dst = page + (addr & DBG_PAGE_MASK);
+		for (int i=0; i<size; i++, val >>= 8) {
+			dst[i] = val;
+		}
+		return 0;
+	}
+
+	// Slow path: partial pages, watched pages and pages holding decoded code
+	mem_region *mem = dbg_find_mem(addr);
+	if (!mem || !(mem->flags & PF_W)) {
+		return DBG_SIGSEGV;
+	}
+	for (int i=0; i<size; i++, val >>= 8) {
+		if (dbg_sys_mem_writeb(addr + i, val)) {
+			return DBG_SIGSEGV;
+		}
+	}
+	if (xt_page_watched(cpu, addr >> DBG_PAGE_SHIFT)) {
+		return xt_wp_check(cpu, addr, size, DBG_WP_WRITE);
+	}
+	return 0;
+}
+
+/*****************************************************************************
+ * Special Registers
+ ****************************************************************************/
+
+#define XT_SR_SAR       3
+#define XT_SR_LITBASE   5
+#define XT_SR_CONFIGID0 176
+#define XT_SR_CONFIGID1 208
+#define XT_SR_PS        230
+#define XT_SR_CCOUNT    234
+
+static uint32_t xt_rsr(struct xt_cpu *cpu, registers *regs, uint32_t sr, uint32_t count)
+{
+	switch (sr) {
+	case XT_SR_SAR:       return regs->sar;
+	case XT_SR_LITBASE:   return regs->litbase;
+	case XT_SR_CONFIGID0: return regs->sr176;
+	case XT_SR_CONFIGID1: return regs->sr208;
+	case XT_SR_PS:        return regs->ps;
+	case XT_SR_CCOUNT:    return cpu->sr[sr] + count;
+	default:              return cpu->sr[sr];
+	}
+}
+
+static void xt_wsr(struct xt_cpu *cpu, registers *regs, uint32_t sr, uint32_t val, uint32_t count)
+{
+	switch (sr) {
+	case XT_SR_SAR:
+		regs->sar = val & 0x3f;
+		break;
+	case XT_SR_LITBASE:
+		// L32R addresses were resolved against the old value
+		regs->litbase = val;
+		cpu->litbase = val;
+		xt_icache_flush(cpu);
+		break;
+	case XT_SR_CONFIGID0:
+	case XT_SR_CONFIGID1:
+		break;
+	case XT_SR_PS:
+		regs->ps = val;
+		break;
+	case XT_SR_CCOUNT:
+		cpu->sr[sr] = val - count;
+		break;
+	default:
+		cpu->sr[sr] = val;
+		break;
+	}
+}
+
+/*****************************************************************************
+ * Decoder
+ ****************************************************************************/
+
+static inline uint32_t sext(uint32_t val, int bits)
+{
+	return (uint32_t)((int32_t)(val << (32 - bits)) >> (32 - bits));
+}
+
+/*
+ * Fetch an instruction byte.  Unlike xt_load this never trips watchpoints.
+ */
+static int xt_fetch(uint32_t addr, uint32_t *val)
+{
+	char ch;
+
+	if (dbg_sys_mem_readb(addr, &ch)) {
+		return EOF;
+	}
+	*val = (uint8_t)ch;
+	return 0;
+}
+
+/*
+ * Decode the instruction at pc into in.
+ */
+static void xt_decode(struct xt_cpu *cpu, registers *regs, uint32_t pc, xt_insn *in)
+{
+	uint32_t b0, b1, b2 = 0;
+	xt_bp *bp = xt_bp_find(&cpu->bps, pc);
+
+	memset(in, 0, sizeof(*in));
+	in->op = XT_OP_ILL;
+	in->bp = bp ? bp->type : 0;
+	if (xt_fetch(pc, &b0) || xt_fetch(pc + 1, &b1)) {
+		in->op = XT_OP_FETCH_FAULT;
+		return;
+	}
+	uint32_t op0 = b0 & 0xf;
+	in->len = (op0 >= 8) ? 2 : 3;
+	if ((in->len == 3) && xt_fetch(pc + 2, &b2)) {
+		in->op = XT_OP_FETCH_FAULT;
+		return;
+	}
+
+	uint32_t insn = b0 | (b1 << 8) | (b2 << 16);
+	uint32_t t    = (insn >> 4) & 0xf;
+	uint32_t s    = (insn >> 8) & 0xf;
+	uint32_t r    = (insn >> 12) & 0xf;
+	uint32_t op1  = (insn >> 16) & 0xf;
+	uint32_t op2  = (insn >> 20) & 0xf;
+	uint32_t imm8 = (insn >> 16) & 0xff;
+
+	#define XT_SET(o, dd, aa, bb) \
+		{ in->op = (o); in->d = (dd); in->a = (aa); in->b = (bb); }
+
+	switch (op0) {
+	case 0: /* QRST */
+		switch (op1) {
+		case 0: /* RST0 */
+			switch (op2) {
+			case 0: /* ST0 */
+				switch (r) {
+				case 0: /* SNM0 */
+					if (t == 0x8) {
+						XT_SET(XT_OP_JX, 0, 0, 0);      /* RET */
+					} else if (t == 0xa) {
+						XT_SET(XT_OP_JX, 0, s, 0);      /* JX */
+					} else if (t == 0xc) {
+						XT_SET(XT_OP_CALLX0, 0, s, 0);  /* CALLX0 */
+					}
+					break;
+				case 2: /* SYNC */
+					if ((t <= 3) || (t == 8) || (t >= 12 && t != 14)) {
+						in->op = XT_OP_NOP;
+					}
+					break;
+				case 4:
+					in->op = XT_OP_BREAK;
+					break;
+				case 5:
+					if (!s && !t) {
+						in->op = XT_OP_SYSCALL;
+					}
+					break;
+				case 6:
+					XT_SET(XT_OP_RSIL, t, 0, 0);
+					in->imm = s;
+					break;
+				case 7:
+					in->op = XT_OP_WAITI;
+					in->imm = s;
+					break;
+				}
+				break;
+			case 1: XT_SET(XT_OP_AND, r, s, t); break;
+			case 2: XT_SET(XT_OP_OR, r, s, t); break;
+			case 3: XT_SET(XT_OP_XOR, r, s, t); break;
+			case 4: /* ST1 */
+				switch (r) {
+				case 0:  XT_SET(XT_OP_SSR, 0, s, 0); break;
+				case 1:  XT_SET(XT_OP_SSL, 0, s, 0); break;
+				case 2:  XT_SET(XT_OP_SSA8L, 0, s, 0); break;
+				case 3:  XT_SET(XT_OP_SSA8B, 0, s, 0); break;
+				case 4:
+					in->op = XT_OP_SSAI;
+					in->imm = s | ((t & 1) << 4);
+					break;
+				case 14: XT_SET(XT_OP_NSA, t, s, 0); break;
+				case 15: XT_SET(XT_OP_NSAU, t, s, 0); break;
+				}
+				break;
+			case 6: /* RT0 */
+				if (s == 0) {
+					XT_SET(XT_OP_NEG, r, t, 0);
+				} else if (s == 1) {
+					XT_SET(XT_OP_ABS, r, t, 0);
+				}
+				break;
+			case 8:  XT_SET(XT_OP_ADD, r, s, t); break;
+			case 9:  XT_SET(XT_OP_ADDX2, r, s, t); break;
+			case 10: XT_SET(XT_OP_ADDX4, r, s, t); break;
+			case 11: XT_SET(XT_OP_ADDX8, r, s, t); break;
+			case 12: XT_SET(XT_OP_SUB, r, s, t); break;
+			case 13: XT_SET(XT_OP_SUBX2, r, s, t); break;
+			case 14: XT_SET(XT_OP_SUBX4, r, s, t); break;
+			case 15: XT_SET(XT_OP_SUBX8, r, s, t); break;
+			}
+			break;
+		case 1: /* RST1 */
+			switch (op2) {
+			case 0:
+			case 1:
+				XT_SET(XT_OP_SLLI, r, s, 0);
+				in->sh = 32 - (((op2 & 1) << 4) | t);
+				break;
+			case 2:
+			case 3:
+				XT_SET(XT_OP_SRAI, r, t, 0);
+				in->sh = ((op2 & 1) << 4) | s;
+				break;
+			case 4:
+				XT_SET(XT_OP_SRLI, r, t, 0);
+				in->sh = s;
+				break;
+			case 6:
+				XT_SET(XT_OP_XSR, t, t, 0);
+				in->imm = (r << 4) | s;
+				break;
+			case 8:  XT_SET(XT_OP_SRC, r, s, t); break;
+			case 9:  XT_SET(XT_OP_SRL, r, t, 0); break;
+			case 10: XT_SET(XT_OP_SLL, r, s, 0); break;
+			case 11: XT_SET(XT_OP_SRA, r, t, 0); break;
+			case 12: XT_SET(XT_OP_MUL16U, r, s, t); break;
+			case 13: XT_SET(XT_OP_MUL16S, r, s, t); break;
+			}
+			break;
+		case 2: /* RST2 */
+			if (op2 == 8) {
+				XT_SET(XT_OP_MULL, r, s, t);
+			}
+			break;
+		case 3: /* RST3 */
+			switch (op2) {
+			case 0:
+				XT_SET(XT_OP_RSR, t, 0, 0);
+				in->imm = (r << 4) | s;
+				break;
+			case 1:
+				XT_SET(XT_OP_WSR, 0, t, 0);
+				in->imm = (r << 4) | s;
+				break;
+			case 8:  XT_SET(XT_OP_MOVEQZ, r, s, t); break;
+			case 9:  XT_SET(XT_OP_MOVNEZ, r, s, t); break;
+			case 10: XT_SET(XT_OP_MOVLTZ, r, s, t); break;
+			case 11: XT_SET(XT_OP_MOVGEZ, r, s, t); break;
+			}
+			break;
+		case 4:
+		case 5:
+			XT_SET(XT_OP_EXTUI, r, t, 0);
+			in->sh = ((op1 & 1) << 4) | s;
+			in->imm = (1u << (op2 + 1)) - 1;
+			break;
+		}
+		break;
+
+	case 1: /* L32R */
+		in->op = XT_OP_L32R;
+		in->d = t;
+		if (regs->litbase & 1) {
+			in->imm = (regs->litbase & 0xfffff000) + (((insn >> 8) | 0xffff0000) << 2);
+		} else {
+			in->imm = ((pc + 3) & ~3) + (((insn >> 8) | 0xffff0000) << 2);
+		}
+		break;
+
+	case 2: /* LSAI */
+		switch (r) {
+		case 0:  XT_SET(XT_OP_L8UI, t, s, 0); in->imm = imm8; break;
+		case 1:  XT_SET(XT_OP_L16UI, t, s, 0); in->imm = imm8 << 1; break;
+		case 2:  XT_SET(XT_OP_L32I, t, s, 0); in->imm = imm8 << 2; break;
+		case 4:  XT_SET(XT_OP_S8I, 0, s, t); in->imm = imm8; break;
+		case 5:  XT_SET(XT_OP_S16I, 0, s, t); in->imm = imm8 << 1; break;
+		case 6:  XT_SET(XT_OP_S32I, 0, s, t); in->imm = imm8 << 2; break;
+		case 7:  in->op = XT_OP_NOP; break; /* cache ops, no caches here */
+		case 9:  XT_SET(XT_OP_L16SI, t, s, 0); in->imm = imm8 << 1; break;
+		case 10: XT_SET(XT_OP_MOVI, t, 0, 0); in->imm = sext((s << 8) | imm8, 12); break;
+		case 11: XT_SET(XT_OP_L32I, t, s, 0); in->imm = imm8 << 2; break; /* L32AI */
+		case 12: XT_SET(XT_OP_ADDI, t, s, 0); in->imm = sext(imm8, 8); break;
+		case 13: XT_SET(XT_OP_ADDI, t, s, 0); in->imm = sext(imm8, 8) << 8; break;
+		case 15: XT_SET(XT_OP_S32I, 0, s, t); in->imm = imm8 << 2; break; /* S32RI */
+		}
+		break;
+
+	case 5: /* CALLN */
+		if ((t & 3) == 0) {
+			in->op = XT_OP_CALL0;
+			in->target = (pc & ~3) + (sext(insn >> 6, 18) << 2) + 4;
+		}
+		break;
+
+	case 6: /* SI */
+		switch (t & 3) {
+		case 0:
+			in->op = XT_OP_J;
+			in->target = pc + 4 + sext(insn >> 6, 18);
+			break;
+		case 1:
+			XT_SET(XT_OP_BEQZ + (t >> 2), 0, s, 0);
+			in->target = pc + 4 + sext(insn >> 12, 12);
+			break;
+		case 2:
+			XT_SET(XT_OP_BEQI + (t >> 2), 0, s, 0);
+			in->imm = b4const[r];
+			in->target = pc + 4 + sext(imm8, 8);
+			break;
+		case 3:
+			if ((t >> 2) >= 2) {
+				XT_SET(XT_OP_BLTUI + (t >> 2) - 2, 0, s, 0);
+				in->imm = b4constu[r];
+				in->target = pc + 4 + sext(imm8, 8);
+			}
+			break;
+		}
+		break;
+
+	case 7: /* B */
+		in->target = pc + 4 + sext(imm8, 8);
+		switch (r) {
+		case 0:  XT_SET(XT_OP_BNONE, 0, s, t); break;
+		case 1:  XT_SET(XT_OP_BEQ, 0, s, t); break;
+		case 2:  XT_SET(XT_OP_BLT, 0, s, t); break;
+		case 3:  XT_SET(XT_OP_BLTU, 0, s, t); break;
+		case 4:  XT_SET(XT_OP_BALL, 0, s, t); break;
+		case 5:  XT_SET(XT_OP_BBC, 0, s, t); break;
+		case 8:  XT_SET(XT_OP_BANY, 0, s, t); break;
+		case 9:  XT_SET(XT_OP_BNE, 0, s, t); break;
+		case 10: XT_SET(XT_OP_BGE, 0, s, t); break;
+		case 11: XT_SET(XT_OP_BGEU, 0, s, t); break;
+		case 12: XT_SET(XT_OP_BNALL, 0, s, t); break;
+		case 13: XT_SET(XT_OP_BBS, 0, s, t); break;
+		case 6:
+		case 7:
+			XT_SET(XT_OP_BBCI, 0, s, 0);
+			in->sh = ((r & 1) << 4) | t;
+			break;
+		case 14:
+		case 15:
+			XT_SET(XT_OP_BBSI, 0, s, 0);
+			in->sh = ((r & 1) << 4) | t;
+			break;
+		}
+		break;
+
+	case 8: /* L32I.N */
+		XT_SET(XT_OP_L32I, t, s, 0);
+		in->imm = r << 2;
+		break;
+	case 9: /* S32I.N */
+		XT_SET(XT_OP_S32I, 0, s, t);
+		in->imm = r << 2;
+		break;
+	case 10: /* ADD.N */
+		XT_SET(XT_OP_ADD, r, s, t);
+		break;
+	case 11: /* ADDI.N */
+		XT_SET(XT_OP_ADDI, r, s, 0);
+		in->imm = t ? t : (uint32_t)-1;
+		break;
+	case 12: /* ST2 */
+		if (!(t & 8)) {
+			/* MOVI.N, immediate range is -32..95 */
+			uint32_t imm7 = ((t & 7) << 4) | r;
+			XT_SET(XT_OP_MOVI, s, 0, 0);
+			in->imm = (imm7 >= 96) ? imm7 - 128 : imm7;
+		} else {
+			XT_SET((t & 4) ? XT_OP_BNEZ : XT_OP_BEQZ, 0, s, 0);
+			in->target = pc + 4 + (((t & 3) << 4) | r);
+		}
+		break;
+	case 13: /* ST3 */
+		if (r == 0) {
+			XT_SET(XT_OP_OR, t, s, s);                   /* MOV.N */
+		} else if (r == 15) {
+			switch (t) {
+			case 0: XT_SET(XT_OP_JX, 0, 0, 0); break;   /* RET.N */
+			case 2: in->op = XT_OP_BREAK; break;        /* BREAK.N */
+			case 3: in->op = XT_OP_NOP; break;          /* NOP.N */
+			}
+		}
+		break;
+	}
+
+	#undef XT_SET
+}
+
+/*****************************************************************************
+ * Execution
+ ****************************************************************************/
+
+static uint32_t xt_nsa(uint32_t val)
+{
+	if ((int32_t)val < 0) {
+		val = ~val;
+	}
+	return val ? __builtin_clz(val) - 1 : 31;
+}
+
+/*
+ * Run from the current PC until the target stops, or for one instruction
+ * if step is set.
+ *
+ * Returns the signal the target stopped with.
+ */
+int xt_run(struct dbg_state *state, int step)
+{
+	struct xt_cpu *cpu = xt_cpu_get(state);
+	registers *regs = &state->regs;
+	uint32_t *ar = regs->a;
+	uint32_t pc = regs->pc;
+	uint32_t next;
+	uint32_t count = 0;
+	uint32_t val;
+	xt_icache_page *page = NULL;
+	int sig = 0;
+
+	state->stop_reason = DBG_STOP_SIGNAL;
+	if (cpu->litbase != regs->litbase) {
+		// Changed by the debugger since the last run
+		cpu->litbase = regs->litbase;
+		xt_icache_flush(cpu);
+	}
+
+	#define XT_BRANCH(cond) \
+		{ if (cond) { next = in->target; } break; }
+	#define XT_LOAD(size, expr) \
+		{ \
+			sig = xt_load(cpu, ar[in->a] + in->imm, size, &val); \
+			if (sig) { \
+				if (sig != XT_WATCH) { \
+					goto stop; \
+				} \
+				ar[in->d] = (expr); \
+				goto watch; \
+			} \
+			ar[in->d] = (expr); \
+			break; \
+		}
+	#define XT_STORE(size) \
+		{ \
+			sig = xt_store(cpu, ar[in->a] + in->imm, size, ar[in->b]); \
+			if (sig) { \
+				if (sig != XT_WATCH) { \
+					goto stop; \
+				} \
+				goto watch; \
+			} \
+			break; \
+		}
+
+	while (1) {
+		if (!page || (page->vpage != (pc >> DBG_PAGE_SHIFT))) {
+			page = xt_icache_get(cpu, pc);
+		}
+		xt_insn *in = &page->insn[pc & DBG_PAGE_MASK];
+		if (in->op == XT_OP_DECODE) {
+			xt_decode(cpu, regs, pc, in);
+		}
+		next = pc + in->len;
+
+		// A breakpoint on the instruction we resume from doesn't fire
+		if (in->bp && count) {
+			state->stop_reason = (in->bp & DBG_BP_SW) ? DBG_STOP_SWBREAK : DBG_STOP_HWBREAK;
+			sig = DBG_SIGTRAP;
+			goto stop;
+		}
+
+		switch (in->op) {
+		case XT_OP_FETCH_FAULT: sig = DBG_SIGSEGV; goto stop;
+		case XT_OP_BREAK:       sig = DBG_SIGTRAP; goto stop;
+		case XT_OP_WAITI:       sig = DBG_SIGTRAP; goto stop;
+		case XT_OP_SYSCALL:     sig = DBG_SIGSYS; goto stop;
+		case XT_OP_NOP:         break;
+		case XT_OP_RSIL:
+			ar[in->d] = regs->ps;
+			regs->ps = (regs->ps & ~0xf) | in->imm;
+			break;
+		case XT_OP_RSR:
+			ar[in->d] = xt_rsr(cpu, regs, in->imm, count);
+			break;
+		case XT_OP_WSR:
+			xt_wsr(cpu, regs, in->imm, ar[in->a], count);
+			break;
+		case XT_OP_XSR:
+			val = xt_rsr(cpu, regs, in->imm, count);
+			xt_wsr(cpu, regs, in->imm, ar[in->a], count);
+			ar[in->d] = val;
+			break;
+
+		case XT_OP_ADD:    ar[in->d] = ar[in->a] + ar[in->b]; break;
+		case XT_OP_ADDX2:  ar[in->d] = (ar[in->a] << 1) + ar[in->b]; break;
+		case XT_OP_ADDX4:  ar[in->d] = (ar[in->a] << 2) + ar[in->b]; break;
+		case XT_OP_ADDX8:  ar[in->d] = (ar[in->a] << 3) + ar[in->b]; break;
+		case XT_OP_SUB:    ar[in->d] = ar[in->a] - ar[in->b]; break;
+		case XT_OP_SUBX2:  ar[in->d] = (ar[in->a] << 1) - ar[in->b]; break;
+		case XT_OP_SUBX4:  ar[in->d] = (ar[in->a] << 2) - ar[in->b]; break;
+		case XT_OP_SUBX8:  ar[in->d] = (ar[in->a] << 3) - ar[in->b]; break;
+		case XT_OP_AND:    ar[in->d] = ar[in->a] & ar[in->b]; break;
+		case XT_OP_OR:     ar[in->d] = ar[in->a] | ar[in->b]; break;
+		case XT_OP_XOR:    ar[in->d] = ar[in->a] ^ ar[in->b]; break;
+		case XT_OP_NEG:    ar[in->d] = -ar[in->a]; break;
+		case XT_OP_ABS:
+			ar[in->d] = ((int32_t)ar[in->a] < 0) ? -ar[in->a] : ar[in->a];
+			break;
+		case XT_OP_ADDI:   ar[in->d] = ar[in->a] + in->imm; break;
+		case XT_OP_MOVI:   ar[in->d] = in->imm; break;
+		case XT_OP_MULL:   ar[in->d] = ar[in->a] * ar[in->b]; break;
+		case XT_OP_MUL16U:
+			ar[in->d] = (ar[in->a] & 0xffff) * (ar[in->b] & 0xffff);
+			break;
+		case XT_OP_MUL16S:
+			ar[in->d] = (int32_t)(int16_t)ar[in->a] * (int16_t)ar[in->b];
+			break;
+
+		case XT_OP_SLLI:
+			ar[in->d] = (uint32_t)((uint64_t)ar[in->a] << in->sh);
+			break;
+		case XT_OP_SRAI:   ar[in->d] = (int32_t)ar[in->a] >> in->sh; break;
+		case XT_OP_SRLI:   ar[in->d] = ar[in->a] >> in->sh; break;
+		case XT_OP_EXTUI:  ar[in->d] = (ar[in->a] >> in->sh) & in->imm; break;
+		case XT_OP_SRC:
+			ar[in->d] = (uint32_t)((((uint64_t)ar[in->a] << 32) | ar[in->b]) >> regs->sar);
+			break;
+		case XT_OP_SRL:
+			ar[in->d] = (uint32_t)((uint64_t)ar[in->a] >> regs->sar);
+			break;
+		case XT_OP_SLL:
+			ar[in->d] = (regs->sar > 32) ? 0 :
+			            (uint32_t)((uint64_t)ar[in->a] << (32 - regs->sar));
+			break;
+		case XT_OP_SRA:
+			ar[in->d] = (uint32_t)((int64_t)(int32_t)ar[in->a] >> regs->sar);
+			break;
+		case XT_OP_SSR:    regs->sar = ar[in->a] & 0x1f; break;
+		case XT_OP_SSL:    regs->sar = 32 - (ar[in->a] & 0x1f); break;
+		case XT_OP_SSA8L:  regs->sar = (ar[in->a] & 3) << 3; break;
+		case XT_OP_SSA8B:  regs->sar = 32 - ((ar[in->a] & 3) << 3); break;
+		case XT_OP_SSAI:   regs->sar = in->imm; break;
+		case XT_OP_NSA:    ar[in->d] = xt_nsa(ar[in->a]); break;
+		case XT_OP_NSAU:
+			ar[in->d] = ar[in->a] ? __builtin_clz(ar[in->a]) : 32;
+			break;
+		case XT_OP_MOVEQZ: if (ar[in->b] == 0) ar[in->d] = ar[in->a]; break;
+		case XT_OP_MOVNEZ: if (ar[in->b] != 0) ar[in->d] = ar[in->a]; break;
+		case XT_OP_MOVLTZ: if ((int32_t)ar[in->b] < 0) ar[in->d] = ar[in->a]; break;
+		case XT_OP_MOVGEZ: if ((int32_t)ar[in->b] >= 0) ar[in->d] = ar[in->a]; break;
+
+		case XT_OP_L8UI:   XT_LOAD(1, val);
+		case XT_OP_L16UI:  XT_LOAD(2, val);
+		case XT_OP_L16SI:  XT_LOAD(2, (int32_t)(int16_t)val);
+		case XT_OP_L32I:   XT_LOAD(4, val);
+		case XT_OP_L32R:
+			sig = xt_load(cpu, in->imm, 4, &val);
+			if (sig) {
+				if (sig != XT_WATCH) {
+					goto stop;
+				}
+				ar[in->d] = val;
+				goto watch;
+			}
+			ar[in->d] = val;
+			break;
+		case XT_OP_S8I:    XT_STORE(1);
+		case XT_OP_S16I:   XT_STORE(2);
+		case XT_OP_S32I:   XT_STORE(4);
+
+		case XT_OP_J:      next = in->target; break;
+		case XT_OP_JX:     next = ar[in->a]; break;
+		case XT_OP_CALL0:
+			ar[0] = next;
+			next = in->target;
+			break;
+		case XT_OP_CALLX0:
+			val = ar[in->a];
+			ar[0] = next;
+			next = val;
+			break;
+
+		case XT_OP_BEQZ:   XT_BRANCH(ar[in->a] == 0);
+		case XT_OP_BNEZ:   XT_BRANCH(ar[in->a] != 0);
+		case XT_OP_BLTZ:   XT_BRANCH((int32_t)ar[in->a] < 0);
+		case XT_OP_BGEZ:   XT_BRANCH((int32_t)ar[in->a] >= 0);
+		case XT_OP_BEQI:   XT_BRANCH(ar[in->a] == in->imm);
+		case XT_OP_BNEI:   XT_BRANCH(ar[in->a] != in->imm);
+		case XT_OP_BLTI:   XT_BRANCH((int32_t)ar[in->a] < (int32_t)in->imm);
+		case XT_OP_BGEI:   XT_BRANCH((int32_t)ar[in->a] >= (int32_t)in->imm);
+		case XT_OP_BLTUI:  XT_BRANCH(ar[in->a] < in->imm);
+		case XT_OP_BGEUI:  XT_BRANCH(ar[in->a] >= in->imm);
+		case XT_OP_BNONE:  XT_BRANCH((ar[in->a] & ar[in->b]) == 0);
+		case XT_OP_BEQ:    XT_BRANCH(ar[in->a] == ar[in->b]);
+		case XT_OP_BLT:    XT_BRANCH((int32_t)ar[in->a] < (int32_t)ar[in->b]);
+		case XT_OP_BLTU:   XT_BRANCH(ar[in->a] < ar[in->b]);
+		case XT_OP_BALL:   XT_BRANCH((~ar[in->a] & ar[in->b]) == 0);
+		case XT_OP_BBC:    XT_BRANCH(!((ar[in->a] >> (ar[in->b] & 0x1f)) & 1));
+		case XT_OP_BANY:   XT_BRANCH((ar[in->a] & ar[in->b]) != 0);
+		case XT_OP_BNE:    XT_BRANCH(ar[in->a] != ar[in->b]);
+		case XT_OP_BGE:    XT_BRANCH((int32_t)ar[in->a] >= (int32_t)ar[in->b]);
+		case XT_OP_BGEU:   XT_BRANCH(ar[in->a] >= ar[in->b]);
+		case XT_OP_BNALL:  XT_BRANCH((~ar[in->a] & ar[in->b]) != 0);
+		case XT_OP_BBS:    XT_BRANCH((ar[in->a] >> (ar[in->b] & 0x1f)) & 1);
+		case XT_OP_BBCI:   XT_BRANCH(!((ar[in->a] >> in->sh) & 1));
+		case XT_OP_BBSI:   XT_BRANCH((ar[in->a] >> in->sh) & 1);
+
+		default:
+			sig = DBG_SIGILL;
+			goto stop;
+		}
+
+		pc = next;
+		count++;
+		if (step) {
+			sig = DBG_SIGTRAP;
+			break;
+		}
+		if (!(count & (XT_POLL_INTERVAL - 1)) && dbg_sys_poll_interrupt()) {
+			sig = DBG_SIGINT;
+			break;
+		}
+	}
+
+	#undef XT_BRANCH
+	#undef XT_LOAD
+	#undef XT_STORE
+
+	goto stop;
+
+watch:
+	// Data watchpoints report after the access, like most targets
+	state->stop_reason = cpu->wps.hit;
+	state->stop_addr = cpu->wps.hit_addr;
+	pc = next;
+	count++;
+	sig = DBG_SIGTRAP;
+
+stop:
+	regs->pc = pc;
+	cpu->sr[XT_SR_CCOUNT] += count;
+	return sig;
+}
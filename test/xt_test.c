@@ -0,0 +1,642 @@
+/*
+ * Copyright (C) 2016  Matt Borgerson
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program; if not, write to the Free Software Foundation, Inc.,
+ * 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA.
+ */
+
+/*
+ * Emulator checks.  Starts a stub with a socketpair for its stdin and
+ * stdout, writes hand-assembled LX106 sequences into the dump's RAM, runs
+ * them with s, c, Z0/Z1 and Z2..Z4 and checks the registers, memory and
+ * stop replies against what the ISA specifies.
+ *
+ *   xt_test -- stub [args...]
+ *
+ * Registers are numbered as in gdb's built-in lx106 layout, the stub's
+ * default.  Exits nonzero if any check fails.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#define PKT_SIZE 0x1000
+
+/* Scratch pages in the dump's RAM */
+#define CODE     0x3ffe9000
+#define DATA     0x3ffea000
+#define LITPAGE  0x3ffeb000
+
+/* gdb's lx106 register numbers */
+#define REG_PC      0
+#define REG_SAR     36
+#define REG_LITBASE 37
+#define REG_PS      42
+#define REG_A(n)    (97 + (n))
+
+/*****************************************************************************
+ * Types
+ ****************************************************************************/
+
+typedef struct conn {
+	int    fd;
+	char   buf[65536];
+	size_t pos;
+	size_t len;
+} conn;
+
+/* A sequence being assembled */
+typedef struct code {
+	uint8_t b[256];
+	size_t  len;
+} code;
+
+/*****************************************************************************
+ * Helpers
+ ****************************************************************************/
+
+static int failures;
+static int checks;
+
+static void die(const char *msg)
+{
+	fprintf(stderr, "xt_test: %s\n", msg);
+	exit(1);
+}
+
+static void check(int ok, const char *fmt, ...)
+{
+	va_list ap;
+
+	checks++;
+	if (ok) {
+		return;
+	}
+	failures++;
+	fprintf(stderr, "FAIL: ");
+	va_start(ap, fmt);
+	vfprintf(stderr, fmt, ap);
+	va_end(ap);
+	fprintf(stderr, "\n");
+}
+
+/*****************************************************************************
+ * Connection
+ ****************************************************************************/
+
+static int conn_getc(conn *c)
+{
+	if (c->pos == c->len) {
+		ssize_t n = read(c->fd, c->buf, sizeof(c->buf));
+		if (n <= 0) {
+			return EOF;
+		}
+		c->pos = 0;
+		c->len = n;
+	}
+	return (unsigned char)c->buf[c->pos++];
+}
+
+static void conn_write(conn *c, const char *data, size_t len)
+{
+	while (len) {
+		ssize_t n = write(c->fd, data, len);
+		if (n <= 0) {
+			die("write to stub failed");
+		}
+		data += n;
+		len -= n;
+	}
+}
+
+/*
+ * Send a request and wait for its acknowledgement and reply.  The reply is
+ * run-length expanded into reply, NUL terminated.
+ *
+ * Returns reply.
+ */
+static const char *transact(conn *c, const char *fmt, ...)
+{
+	static char frame[2 * PKT_SIZE];
+	static char reply[4 * PKT_SIZE];
+	char req[2 * PKT_SIZE];
+	unsigned char csum = 0;
+	size_t len = 0, req_len;
+	va_list ap;
+	int ch;
+
+	va_start(ap, fmt);
+	req_len = vsnprintf(req, sizeof(req), fmt, ap);
+	va_end(ap);
+
+	frame[len++] = '$';
+	for (size_t i = 0; i < req_len; i++) {
+		frame[len++] = req[i];
+		csum += (unsigned char)req[i];
+	}
+	len += sprintf(&frame[len], "#%02x", csum);
+	conn_write(c, frame, len);
+
+	if ((ch = conn_getc(c)) != '+') {
+		die("request not acknowledged");
+	}
+	while ((ch = conn_getc(c)) != '$') {
+		if (ch == EOF) {
+			die("stub closed the connection");
+		}
+	}
+
+	/* Reply data up to '#', then the two checksum digits */
+	csum = 0;
+	len = 0;
+	while ((ch = conn_getc(c)) != '#') {
+		if (ch == EOF) {
+			die("stub closed the connection");
+		}
+		csum += ch;
+		if (ch == '*' && len) {
+			int count = conn_getc(c);
+			csum += count;
+			for (count -= 29; count > 0 && len < sizeof(reply) - 1; count--) {
+				reply[len] = reply[len - 1];
+				len++;
+			}
+		} else if (len < sizeof(reply) - 1) {
+			reply[len++] = ch;
+		}
+	}
+	reply[len] = '\0';
+	char digits[3] = { conn_getc(c), conn_getc(c), 0 };
+	if (strtoul(digits, NULL, 16) != csum) {
+		die("bad reply checksum");
+	}
+	conn_write(c, "+", 1);
+	return reply;
+}
+
+/*****************************************************************************
+ * Target Access
+ ****************************************************************************/
+
+static void set_reg(conn *c, int n, uint32_t val)
+{
+	const char *r = transact(c, "P%x=%02x%02x%02x%02x", n, val & 0xff,
+	                         (val >> 8) & 0xff, (val >> 16) & 0xff, val >> 24);
+	check(!strcmp(r, "OK"), "P%x: %s", n, r);
+}
+
+static uint32_t get_reg(conn *c, int n)
+{
+	const char *r = transact(c, "p%x", n);
+	unsigned b[4];
+
+	if (sscanf(r, "%2x%2x%2x%2x", &b[0], &b[1], &b[2], &b[3]) != 4) {
+		check(0, "p%x: %s", n, r);
+		return 0;
+	}
+	return b[0] | (b[1] << 8) | (b[2] << 16) | (b[3] << 24);
+}
+
+static void put(conn *c, uint32_t addr, const uint8_t *data, size_t len)
+{
+	char hex[2 * PKT_SIZE];
+	const char *r;
+
+	for (size_t i = 0; i < len; i++) {
+		sprintf(&hex[2 * i], "%02x", data[i]);
+	}
+	r = transact(c, "M%x,%zx:%s", addr, len, hex);
+	check(!strcmp(r, "OK"), "M%x: %s", addr, r);
+}
+
+static void put32(conn *c, uint32_t addr, uint32_t val)
+{
+	uint8_t b[4] = { val, val >> 8, val >> 16, val >> 24 };
+	put(c, addr, b, 4);
+}
+
+static uint32_t get32(conn *c, uint32_t addr)
+{
+	const char *r = transact(c, "m%x,4", addr);
+	unsigned b[4];
+
+	if (sscanf(r, "%2x%2x%2x%2x", &b[0], &b[1], &b[2], &b[3]) != 4) {
+		check(0, "m%x: %s", addr, r);
+		return 0;
+	}
+	return b[0] | (b[1] << 8) | (b[2] << 16) | (b[3] << 24);
+}
+
+/*
+ * Load a sequence at addr and point PC at it.
+ */
+static void load(conn *c, uint32_t addr, code *k)
+{
+	put(c, addr, k->b, k->len);
+	set_reg(c, REG_PC, addr);
+}
+
+static void expect_reply(conn *c, const char *req, const char *want)
+{
+	const char *r = transact(c, "%s", req);
+	check(!strcmp(r, want), "%s: got %s, want %s", req, r, want);
+}
+
+static void expect_reg(conn *c, int n, uint32_t want, const char *what)
+{
+	uint32_t val = get_reg(c, n);
+	check(val == want, "%s: got %08x, want %08x", what, val, want);
+}
+
+/*****************************************************************************
+ * Assembler
+ ****************************************************************************/
+
+static void emit24(code *k, uint32_t insn)
+{
+	k->b[k->len++] = insn;
+	k->b[k->len++] = insn >> 8;
+	k->b[k->len++] = insn >> 16;
+}
+
+static void emit16(code *k, uint32_t insn)
+{
+	k->b[k->len++] = insn;
+	k->b[k->len++] = insn >> 8;
+}
+
+static void rrr(code *k, int op2, int op1, int r, int s, int t)
+{
+	emit24(k, (op2 << 20) | (op1 << 16) | (r << 12) | (s << 8) | (t << 4));
+}
+
+static void rri8(code *k, int op0, int r, int s, int t, int imm8)
+{
+	emit24(k, ((imm8 & 0xff) << 16) | (r << 12) | (s << 8) | (t << 4) | op0);
+}
+
+static void rrrn(code *k, int op0, int r, int s, int t)
+{
+	emit16(k, (r << 12) | (s << 8) | (t << 4) | op0);
+}
+
+static void break_n(code *k)               { rrrn(k, 13, 15, 0, 2); }
+static void nop_n(code *k)                 { rrrn(k, 13, 15, 0, 3); }
+static void mov_n(code *k, int at, int as) { rrrn(k, 13, 0, as, at); }
+static void add_n(code *k, int ar, int as, int at) { rrrn(k, 10, ar, as, at); }
+
+/* imm is 1..15 or -1 */
+static void addi_n(code *k, int ar, int as, int imm)
+{
+	rrrn(k, 11, ar, as, (imm == -1) ? 0 : imm);
+}
+
+/* imm is -32..95 */
+static void movi_n(code *k, int as, int imm)
+{
+	rrrn(k, 12, imm & 0xf, as, (imm >> 4) & 7);
+}
+
+static void l32i_n(code *k, int at, int as, int off) { rrrn(k, 8, off >> 2, as, at); }
+static void s32i_n(code *k, int at, int as, int off) { rrrn(k, 9, off >> 2, as, at); }
+
+static void movi(code *k, int at, int imm)
+{
+	rri8(k, 2, 10, (imm >> 8) & 0xf, at, imm);
+}
+
+static void l32i(code *k, int at, int as, int off) { rri8(k, 2, 2, as, at, off >> 2); }
+static void s32i(code *k, int at, int as, int off) { rri8(k, 2, 6, as, at, off >> 2); }
+
+/* imm16 is the word offset, as a negative 16-bit field */
+static void l32r(code *k, int at, uint32_t imm16)
+{
+	emit24(k, (imm16 << 8) | (at << 4) | 1);
+}
+
+/* offset is from the J's address plus 4 */
+static void j(code *k, int offset)
+{
+	emit24(k, ((offset & 0x3ffff) << 6) | 6);
+}
+
+/*****************************************************************************
+ * Checks
+ ****************************************************************************/
+
+/*
+ * Code density: MOVI.N's asymmetric range, ADD.N, ADDI.N's -1 encoding,
+ * MOV.N and the narrow loads and stores, run to a BREAK.N.
+ */
+static void test_narrow(conn *c)
+{
+	code k = { .len = 0 };
+
+	movi_n(&k, 3, 95);
+	movi_n(&k, 4, -32);
+	add_n(&k, 5, 3, 4);
+	addi_n(&k, 6, 5, -1);
+	mov_n(&k, 7, 6);
+	s32i_n(&k, 7, 8, 4);
+	l32i_n(&k, 9, 8, 4);
+	break_n(&k);
+	put32(c, DATA + 4, 0);
+	set_reg(c, REG_A(8), DATA);
+	load(c, CODE, &k);
+
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_PC, CODE + k.len - 2, "narrow: pc left on BREAK.N");
+	expect_reg(c, REG_A(3), 95, "MOVI.N a3, 95");
+	expect_reg(c, REG_A(4), (uint32_t)-32, "MOVI.N a4, -32");
+	expect_reg(c, REG_A(5), 63, "ADD.N");
+	expect_reg(c, REG_A(6), 62, "ADDI.N -1");
+	expect_reg(c, REG_A(7), 62, "MOV.N");
+	expect_reg(c, REG_A(9), 62, "L32I.N");
+	check(get32(c, DATA + 4) == 62, "S32I.N stored");
+}
+
+/*
+ * MOVI's 12-bit immediate and L32R, PC-relative and then through LITBASE,
+ * with LITBASE changed between runs of the same code.
+ */
+static void test_l32r(conn *c)
+{
+	code k = { .len = 0 };
+	uint32_t at = CODE + 0x100;
+
+	movi(&k, 11, -5);
+	l32r(&k, 10, 0xfff0);  /* 16 words back */
+	break_n(&k);
+	/* PC-relative, from the L32R's address plus 3 rounded down */
+	put32(c, ((at + 3 + 3) & ~3) - 64, 0x12345678);
+	put32(c, LITPAGE - 64, 0x9abcdef0);
+
+	set_reg(c, REG_LITBASE, 0);
+	load(c, at, &k);
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_A(11), (uint32_t)-5, "MOVI a11, -5");
+	expect_reg(c, REG_A(10), 0x12345678, "L32R, PC-relative");
+
+	set_reg(c, REG_LITBASE, LITPAGE | 1);
+	set_reg(c, REG_A(10), 0);
+	set_reg(c, REG_PC, at);
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_A(10), 0x9abcdef0, "L32R, LITBASE");
+
+	set_reg(c, REG_LITBASE, 0);
+	set_reg(c, REG_PC, at);
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_A(10), 0x12345678, "L32R after LITBASE cleared");
+}
+
+/*
+ * EXTUI and the shifts, including the split shift-amount fields and SAR
+ * as set by SSAI, SSL and SSR.
+ */
+static void test_shifts(conn *c)
+{
+	code k = { .len = 0 };
+
+	rrr(&k, 8 - 1, 4 | (20 >> 4), 10, 20 & 15, 11);    /* EXTUI a10, a11, 20, 8 */
+	rrr(&k, 4, 0, 4, 8, 0);                            /* SSAI 8 */
+	rrr(&k, 8, 1, 12, 13, 14);                         /* SRC a12, a13, a14 */
+	rrr(&k, (32 - 4) >> 4, 1, 15, 13, (32 - 4) & 15);  /* SLLI a15, a13, 4 */
+	rrr(&k, 2 | (16 >> 4), 1, 2, 16 & 15, 11);         /* SRAI a2, a11, 16 */
+	rrr(&k, 4, 1, 3, 12, 11);                          /* SRLI a3, a11, 12 */
+	rrr(&k, 4, 0, 1, 4, 0);                            /* SSL a4 */
+	rrr(&k, 10, 1, 5, 13, 0);                          /* SLL a5, a13 */
+	rrr(&k, 4, 0, 0, 4, 0);                            /* SSR a4 */
+	rrr(&k, 9, 1, 6, 0, 11);                           /* SRL a6, a11 */
+	rrr(&k, 11, 1, 7, 0, 11);                          /* SRA a7, a11 */
+	break_n(&k);
+	set_reg(c, REG_A(4), 8);
+	set_reg(c, REG_A(11), 0xdeadbeef);
+	set_reg(c, REG_A(13), 0x11223344);
+	set_reg(c, REG_A(14), 0x55667788);
+	load(c, CODE, &k);
+
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_A(10), 0xea, "EXTUI");
+	expect_reg(c, REG_A(12), 0x44556677, "SRC by SSAI 8");
+	expect_reg(c, REG_A(15), 0x12233440, "SLLI 4");
+	expect_reg(c, REG_A(2), 0xffffdead, "SRAI 16");
+	expect_reg(c, REG_A(3), 0x000deadb, "SRLI 12");
+	expect_reg(c, REG_A(5), 0x22334400, "SLL by SSL 8");
+	expect_reg(c, REG_A(6), 0x00deadbe, "SRL by SSR 8");
+	expect_reg(c, REG_A(7), 0xffdeadbe, "SRA by SSR 8");
+	expect_reg(c, REG_SAR, 8, "SAR after SSR");
+}
+
+/*
+ * The immediate branches, which compare against b4const or b4constu, and
+ * the narrow branches.  Each is a single step from CODE.
+ */
+static void test_branches(conn *c)
+{
+	static const struct {
+		const char *name;
+		int      n, m;     /* BRI8 major and minor opcode fields */
+		int      r;        /* b4const index */
+		uint32_t val;
+		int      imm8;
+		int      taken;
+	} cases[] = {
+		{ "BEQI -1",        2, 0, 0,  0xffffffff, 0x10, 1 },
+		{ "BEQI -1 back",   2, 0, 0,  0xffffffff, 0xf0, 1 },
+		{ "BEQI 256",       2, 0, 15, 255,        0x10, 0 },
+		{ "BNEI 10",        2, 1, 9,  10,         0x10, 0 },
+		{ "BLTI 8",         2, 2, 8,  0xfffffff0, 0x10, 1 },
+		{ "BGEI 16",        2, 3, 11, 16,         0x10, 1 },
+		{ "BLTUI 32768",    3, 2, 0,  32767,      0x10, 1 },
+		{ "BGEUI 65536",    3, 3, 1,  0xfffffff0, 0x10, 1 },
+		{ "BGEUI 65536 no", 3, 3, 1,  65535,      0x10, 0 },
+	};
+	char name[32];
+
+	for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); i++) {
+		code k = { .len = 0 };
+		uint32_t want;
+
+		rri8(&k, 6, cases[i].r, 2, (cases[i].m << 2) | cases[i].n, cases[i].imm8);
+		set_reg(c, REG_A(2), cases[i].val);
+		load(c, CODE, &k);
+		expect_reply(c, "s", "S05");
+		want = cases[i].taken ? CODE + 4 + (int8_t)cases[i].imm8 : CODE + 3;
+		expect_reg(c, REG_PC, want, cases[i].name);
+	}
+
+	/* BNEZ.N a2, +20 and BEQZ.N a2, +20 */
+	for (int bnez = 0; bnez < 2; bnez++) {
+		code k = { .len = 0 };
+
+		rrrn(&k, 12, 20 & 15, 2, 8 | (bnez << 2) | (20 >> 4));
+		set_reg(c, REG_A(2), 1);
+		load(c, CODE, &k);
+		expect_reply(c, "s", "S05");
+		snprintf(name, sizeof(name), "%s.N", bnez ? "BNEZ" : "BEQZ");
+		expect_reg(c, REG_PC, bnez ? CODE + 24 : CODE + 2, name);
+	}
+}
+
+/*
+ * Breakpoints: one on the PC being resumed from must not fire until the
+ * target comes back round to it.
+ */
+static void test_breakpoints(conn *c)
+{
+	code k = { .len = 0 };
+	char req[32];
+
+	addi_n(&k, 2, 2, 1);    /* CODE */
+	j(&k, -6);              /* CODE + 2, back to CODE */
+	set_reg(c, REG_A(2), 0);
+	load(c, CODE, &k);
+
+	snprintf(req, sizeof(req), "Z0,%x,2", CODE);
+	expect_reply(c, req, "OK");
+	expect_reply(c, "c", "T05swbreak:;");
+	expect_reg(c, REG_PC, CODE, "Z0 stop");
+	expect_reg(c, REG_A(2), 1, "Z0 at the resume PC ran once first");
+	expect_reply(c, "c", "T05swbreak:;");
+	expect_reg(c, REG_A(2), 2, "Z0 again after one loop");
+	req[0] = 'z';
+	expect_reply(c, req, "OK");
+
+	snprintf(req, sizeof(req), "Z1,%x,3", CODE + 2);
+	expect_reply(c, req, "OK");
+	expect_reply(c, "c", "T05hwbreak:;");
+	expect_reg(c, REG_PC, CODE + 2, "Z1 stop");
+	expect_reg(c, REG_A(2), 3, "Z1 after the ADDI.N");
+	expect_reply(c, "s", "S05");
+	expect_reg(c, REG_PC, CODE, "step off a Z1");
+	req[0] = 'z';
+	expect_reply(c, req, "OK");
+
+	/* With both removed, nothing stops short of a BREAK.N */
+	k.len = 0;
+	nop_n(&k);
+	break_n(&k);
+	load(c, CODE, &k);
+	expect_reply(c, "c", "S05");
+	expect_reg(c, REG_PC, CODE + 2, "BREAK.N with breakpoints removed");
+}
+
+/*
+ * Watchpoints report after the access, with the data address, and leave
+ * PC on the next instruction.
+ */
+static void test_watchpoints(conn *c)
+{
+	code k = { .len = 0 };
+	uint32_t addr = DATA + 0x10;
+	char req[32], want[32];
+
+	s32i(&k, 3, 8, 0);
+	l32i(&k, 4, 8, 0);
+	break_n(&k);
+	put32(c, addr, 0);
+	set_reg(c, REG_A(3), 0xcafef00d);
+	set_reg(c, REG_A(4), 0);
+	set_reg(c, REG_A(8), addr);
+	load(c, CODE, &k);
+
+	snprintf(req, sizeof(req), "Z2,%x,4", addr);
+	expect_reply(c, req, "OK");
+	snprintf(want, sizeof(want), "T05watch:%08x;", addr);
+	expect_reply(c, "c", want);
+	expect_reg(c, REG_PC, CODE + 3, "Z2 stop after the S32I");
+	check(get32(c, addr) == 0xcafef00d, "Z2: store done before the stop");
+	req[0] = 'z';
+	expect_reply(c, req, "OK");
+
+	snprintf(req, sizeof(req), "Z3,%x,4", addr);
+	expect_reply(c, req, "OK");
+	snprintf(want, sizeof(want), "T05rwatch:%08x;", addr);
+	expect_reply(c, "c", want);
+	expect_reg(c, REG_PC, CODE + 6, "Z3 stop after the L32I");
+	expect_reg(c, REG_A(4), 0xcafef00d, "Z3: load done before the stop");
+	req[0] = 'z';
+	expect_reply(c, req, "OK");
+
+	snprintf(req, sizeof(req), "Z4,%x,4", addr);
+	expect_reply(c, req, "OK");
+	set_reg(c, REG_PC, CODE);
+	snprintf(want, sizeof(want), "T05awatch:%08x;", addr);
+	expect_reply(c, "c", want);
+	expect_reg(c, REG_PC, CODE + 3, "Z4 stop on the write");
+	expect_reply(c, "c", want);
+	expect_reg(c, REG_PC, CODE + 6, "Z4 stop on the read");
+	req[0] = 'z';
+	expect_reply(c, req, "OK");
+	expect_reply(c, "c", "S05");
+}
+
+/*****************************************************************************
+ * Main
+ ****************************************************************************/
+
+int main(int argc, char **argv)
+{
+	int i, sv[2];
+	conn *c;
+	pid_t pid;
+
+	for (i = 1; i < argc && strcmp(argv[i], "--"); i++) {
+	}
+	if (i+1 >= argc) {
+		fprintf(stderr, "usage: xt_test -- stub [args...]\n");
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM, 0, sv)) {
+		die("socketpair failed");
+	}
+	pid = fork();
+	if (pid == 0) {
+		dup2(sv[1], 0);
+		dup2(sv[1], 1);
+		close(sv[0]);
+		close(sv[1]);
+		execvp(argv[i+1], &argv[i+1]);
+		perror(argv[i+1]);
+		_exit(127);
+	}
+	close(sv[1]);
+	signal(SIGPIPE, SIG_IGN);
+
+	c = (conn*)calloc(1, sizeof(conn));
+	c->fd = sv[0];
+
+	transact(c, "qSupported");
+	test_narrow(c);
+	test_l32r(c);
+	test_shifts(c);
+	test_branches(c);
+	test_breakpoints(c);
+	test_watchpoints(c);
+	expect_reply(c, "D", "OK");
+
+	close(c->fd);
+	waitpid(pid, NULL, 0);
+
+	printf("xt_test: %d of %d checks passed\n", checks - failures, checks);
+	return failures ? 1 : 0;
+}